@@ -35,13 +35,15 @@ lsdf_bytes () {
 }
 
 
-# numerical compare wrapper (print_result compatible)
+# numerical compare wrapper (print_result compatible); test(1) does the
+# comparison, an empty or non-numeric operand counts as a failure
 num_expect () {
     local lhs=$1 op=$2 rhs=$3 msg=$4
-    if [[ $(awk "BEGIN{print ($lhs $op $rhs)?0:1}") -eq 0 ]]; then
+    if [ "$lhs" "$op" "$rhs" ] 2>/dev/null; then
         print_result 0 "$msg" 0
     else
         print_result 1 "$msg" 0
+        printf '        wanted %s %s %s\n' "${lhs:-<empty>}" "$op" "${rhs:-<empty>}"
     fi
 }
 
@@ -101,11 +103,11 @@ print_result $? 'round-trip data identical' 0
 rm -f "$EXT_IN" "$EXT_OUT"
 
 ###############################################################################
-# lsdf  (size should be 1 KiB)
+# lsdf  (tiny files are stored inline in the inode -> no blocks)
 ###############################################################################
 sz=$(lsdf_bytes /greeting.txt)
 print_result $? 'lsdf runs' 0
-num_expect "$sz" -eq "$BLOCKSIZE" 'lsdf returns 1-block allocation for small file'
+num_expect "$sz" -eq 0 'lsdf returns no block allocation for inline file'
 
 ###############################################################################
 # hard-link, unlink, ref-count behaviour
@@ -134,25 +136,28 @@ num_expect "$(df_field "$df4" 'Free Inodes:')" -eq "$ui3" \
 "$VFS_EXEC" "$IMAGE" rm /link.txt >/dev/null 2>&1
 print_result $? 'rm final link' 0
 df5="$("$VFS_EXEC" "$IMAGE" df)"
-num_expect "$(df_field "$df5" 'Free Blocks:')" -gt "$fb3" \
-            'blocks freed after last link'
+num_expect "$(df_field "$df5" 'Free Blocks:')" -ge "$fb3" \
+            'blocks not lost after last link (greeting.txt was inline)'
 num_expect "$(df_field "$df5" 'Free Inodes:')" -gt "$ui3" \
             'inode freed after last link'
 
 ###############################################################################
 # ext / red   (allocate & release blocks)
 ###############################################################################
-# create 2 000-byte file via ecpt
-PAYLOAD=$(mktemp tmp.pay.XXXX); head -c 2000 </dev/zero >"$PAYLOAD"
+# create 2 000-byte file via ecpt (random data: zero blocks would be holes)
+PAYLOAD=$(mktemp tmp.pay.XXXX); head -c 2000 </dev/urandom >"$PAYLOAD"
 "$VFS_EXEC" "$IMAGE" ecpt "$PAYLOAD" /grow.txt >/dev/null 2>&1
 sz0=$(lsdf_bytes /grow.txt)           # should be 2048
 printf '[PASS] initial size 2000 -> %d B on disk\n' "$sz0"; ((PASS++))
 
-# extend by 1 500 -> size 3 500 (4 blocks on disk)
+# extend by 1 500 -> size 3 500 (still 2 blocks on disk, the rest is a hole)
 "$VFS_EXEC" "$IMAGE" ext /grow.txt 1500 >/dev/null 2>&1
 print_result $? 'ext succeeds' 0
 sz1=$(lsdf_bytes /grow.txt)
-num_expect "$sz1" -eq $((4*BLOCKSIZE)) 'size after ext is 4 blocks'
+num_expect "$sz1" -eq $((2*BLOCKSIZE)) 'size after ext is 2 blocks (sparse)'
+"$VFS_EXEC" "$IMAGE" ls /grow.txt | grep -q '3500 bytes'
+print_result $? 'ext sets logical size' 0
+dfx="$("$VFS_EXEC" "$IMAGE" df)"
 
 # reduce by 3 000 -> size 500 (1 block on disk)
 "$VFS_EXEC" "$IMAGE" red /grow.txt 3000 >/dev/null 2>&1
@@ -160,13 +165,340 @@ print_result $? 'red succeeds' 0
 sz2=$(lsdf_bytes /grow.txt)
 num_expect "$sz2" -eq $((1*BLOCKSIZE)) 'size after red is 1 block'
 df6="$("$VFS_EXEC" "$IMAGE" df)"
-num_expect "$(df_field "$df6" 'Free Blocks:')" -gt "$(df_field "$df5" 'Free Blocks:')" \
+num_expect "$(df_field "$df6" 'Free Blocks:')" -gt "$(df_field "$dfx" 'Free Blocks:')" \
             'blocks freed after red'
 
 # extend beyond the 12 KB limit should fail
 "$VFS_EXEC" "$IMAGE" ext /grow.txt 13000 >/dev/null 2>&1
 print_result $? 'ext beyond 12 KiB fails' 1
 
+###############################################################################
+# inline data  (<= 48 bytes live in the inode, promoted on ext)
+###############################################################################
+TINY=$(mktemp tmp.tiny.XXXX); TINY_OUT=$(mktemp tmp.tinyout.XXXX)
+printf 'lock' >"$TINY"
+dfa="$("$VFS_EXEC" "$IMAGE" df)"
+"$VFS_EXEC" "$IMAGE" ecpt "$TINY" /tiny >/dev/null 2>&1
+print_result $? 'ecpt tiny file' 0
+dfb="$("$VFS_EXEC" "$IMAGE" df)"
+num_expect "$(df_field "$dfb" 'Free Blocks:')" -eq "$(df_field "$dfa" 'Free Blocks:')" \
+            'tiny file uses no data block'
+"$VFS_EXEC" "$IMAGE" ext /tiny 2000 >/dev/null 2>&1
+print_result $? 'ext promotes inline file' 0
+"$VFS_EXEC" "$IMAGE" ecpf /tiny "$TINY_OUT" >/dev/null 2>&1
+{ cat "$TINY"; head -c 2000 </dev/zero; } | cmp -s - "$TINY_OUT"
+print_result $? 'promoted file keeps data and zero tail' 0
+"$VFS_EXEC" "$IMAGE" rm /tiny >/dev/null 2>&1
+
+###############################################################################
+# compression  (per file with ecpt -z, whole image with mkfs ... compress)
+###############################################################################
+TEXT=$(mktemp tmp.text.XXXX); TEXT_OUT=$(mktemp tmp.textout.XXXX)
+yes 'compressible payload line' | head -c 10000 >"$TEXT"
+"$VFS_EXEC" "$IMAGE" ecpt -z "$TEXT" /packed.txt >/dev/null 2>&1
+print_result $? 'ecpt -z compresses file' 0
+num_expect "$(lsdf_bytes /packed.txt)" -lt 10000 'compressed file uses fewer blocks'
+"$VFS_EXEC" "$IMAGE" ecpf /packed.txt "$TEXT_OUT" >/dev/null 2>&1
+cmp -s "$TEXT" "$TEXT_OUT"
+print_result $? 'compressed round-trip identical' 0
+"$VFS_EXEC" "$IMAGE" red /packed.txt 4000 >/dev/null 2>&1
+"$VFS_EXEC" "$IMAGE" ecpf /packed.txt "$TEXT_OUT" >/dev/null 2>&1
+head -c 6000 "$TEXT" | cmp -s - "$TEXT_OUT"
+print_result $? 'red on compressed file keeps prefix' 0
+"$VFS_EXEC" "$IMAGE" rm /packed.txt >/dev/null 2>&1
+
+ZIMG=tmp.z.img
+"$VFS_EXEC" "$ZIMG" mkfs "$DISK_SIZE" compress >/dev/null 2>&1
+"$VFS_EXEC" "$ZIMG" ecpt "$TEXT" /t >/dev/null 2>&1
+num_expect "$("$VFS_EXEC" "$ZIMG" lsdf /t | sed -E 's/.*: ([0-9]+) bytes.*/\1/')" -lt 10000 \
+            'mkfs compress packs ecpt files'
+
+###############################################################################
+# dedup  (mkfs ... dedup shares identical blocks, dedup-scan for old images)
+###############################################################################
+DIMG=tmp.d.img; RND=$(mktemp tmp.rnd.XXXX)
+head -c 8000 </dev/urandom >"$RND"
+"$VFS_EXEC" "$DIMG" mkfs "$DISK_SIZE" dedup >/dev/null 2>&1
+"$VFS_EXEC" "$DIMG" ecpt "$RND" /one >/dev/null 2>&1
+d1="$("$VFS_EXEC" "$DIMG" df)"
+"$VFS_EXEC" "$DIMG" ecpt "$RND" /two >/dev/null 2>&1
+print_result $? 'ecpt duplicate into dedup image' 0
+d2="$("$VFS_EXEC" "$DIMG" df)"
+num_expect "$(df_field "$d2" 'Free Blocks:')" -eq "$(df_field "$d1" 'Free Blocks:')" \
+            'duplicate file takes no new blocks'
+"$VFS_EXEC" "$DIMG" rm /one >/dev/null 2>&1
+"$VFS_EXEC" "$DIMG" ecpf /two "$EXT_OUT" >/dev/null 2>&1
+cmp -s "$RND" "$EXT_OUT"
+print_result $? 'shared blocks survive rm of the other copy' 0
+
+# write/rm churn on a tiny image: freed entries must not clog the index
+TIMG=tmp.dt.img; "$VFS_EXEC" "$TIMG" mkfs 65536 dedup >/dev/null 2>&1
+for i in $(seq 1 100); do
+    head -c 12288 </dev/urandom >"$EXT_OUT"
+    timeout 5 "$VFS_EXEC" "$TIMG" ecpt "$EXT_OUT" /churn >/dev/null 2>&1 || break
+    "$VFS_EXEC" "$TIMG" rm /churn >/dev/null 2>&1
+done
+num_expect "$i" -eq 100 'dedup index survives write/rm churn'
+rm -f "$TIMG"
+
+"$VFS_EXEC" "$IMAGE" ecpt "$RND" /dupA >/dev/null 2>&1
+"$VFS_EXEC" "$IMAGE" ecpt "$RND" /dupB >/dev/null 2>&1
+"$VFS_EXEC" "$IMAGE" dedup-scan | grep -q ' 8 shared'
+print_result $? 'dedup-scan shares existing duplicates' 0
+"$VFS_EXEC" "$IMAGE" rm /dupA >/dev/null 2>&1
+"$VFS_EXEC" "$IMAGE" rm /dupB >/dev/null 2>&1
+
+###############################################################################
+# cp --reflink  (shares blocks, copies only what gets modified)
+###############################################################################
+"$VFS_EXEC" "$IMAGE" ecpt "$RND" /orig >/dev/null 2>&1
+r1="$("$VFS_EXEC" "$IMAGE" df)"
+"$VFS_EXEC" "$IMAGE" cp --reflink /orig /clone >/dev/null 2>&1
+print_result $? 'cp --reflink' 0
+r2="$("$VFS_EXEC" "$IMAGE" df)"
+num_expect "$(df_field "$r2" 'Free Blocks:')" -eq "$(df_field "$r1" 'Free Blocks:')" \
+            'reflink copy takes no data blocks'
+"$VFS_EXEC" "$IMAGE" red /clone 3000 >/dev/null 2>&1
+"$VFS_EXEC" "$IMAGE" ecpf /orig "$EXT_OUT" >/dev/null 2>&1
+cmp -s "$RND" "$EXT_OUT"
+print_result $? 'red on clone leaves original intact' 0
+"$VFS_EXEC" "$IMAGE" ecpf /clone "$EXT_OUT" >/dev/null 2>&1
+head -c 5000 "$RND" | cmp -s - "$EXT_OUT"
+print_result $? 'clone sees its own truncation' 0
+"$VFS_EXEC" "$IMAGE" rm /orig >/dev/null 2>&1
+"$VFS_EXEC" "$IMAGE" rm /clone >/dev/null 2>&1
+
+###############################################################################
+# sparse files  (zero blocks are holes in the image and on the host)
+###############################################################################
+SPARSE=$(mktemp tmp.sparse.XXXX); SPARSE_OUT=$(mktemp tmp.sparseout.XXXX)
+{ head -c 1024 </dev/urandom; head -c 8192 </dev/zero; head -c 1024 </dev/urandom; } >"$SPARSE"
+"$VFS_EXEC" "$IMAGE" ecpt "$SPARSE" /sparse >/dev/null 2>&1
+num_expect "$(lsdf_bytes /sparse)" -eq $((2*BLOCKSIZE)) 'zero blocks are not allocated'
+"$VFS_EXEC" "$IMAGE" ecpf /sparse "$SPARSE_OUT" >/dev/null 2>&1
+cmp -s "$SPARSE" "$SPARSE_OUT"
+print_result $? 'sparse round-trip identical' 0
+num_expect "$(du -k "$SPARSE_OUT" | cut -f1)" -lt 10 'ecpf leaves holes on the host'
+"$VFS_EXEC" "$IMAGE" rm /sparse >/dev/null 2>&1
+
+###############################################################################
+# placement  (a file with a known size gets one contiguous run)
+###############################################################################
+PIMG=tmp.p.img; PTRACE=tmp.p.trace
+ONE=$(mktemp tmp.one.XXXX); FIVE=$(mktemp tmp.five.XXXX)
+head -c 1000 </dev/urandom >"$ONE"; head -c 5000 </dev/urandom >"$FIVE"
+"$VFS_EXEC" "$PIMG" mkfs "$DISK_SIZE" >/dev/null 2>&1
+for f in a b c d; do "$VFS_EXEC" "$PIMG" ecpt "$ONE" /$f >/dev/null 2>&1; done
+"$VFS_EXEC" "$PIMG" rm /b >/dev/null 2>&1        # leaves a 1-block gap
+"$VFS_EXEC" "$PIMG" rm /d >/dev/null 2>&1
+"$VFS_EXEC" --trace="$PTRACE" "$PIMG" ecpt "$FIVE" /five >/dev/null 2>&1
+./vfs-replay -d "$PTRACE" | grep -o 'wb[0-9]*' | head -5 | tr -d wb |
+    awk 'NR>1 && $1!=prev+1{bad=1} {prev=$1} END{exit bad}'
+print_result $? 'ecpt data blocks are contiguous despite the gap' 0
+
+###############################################################################
+# frag / defrag
+###############################################################################
+FIMG=tmp.f.img
+TWO=$(mktemp tmp.two.XXXX); FOUR=$(mktemp tmp.four.XXXX); THREE=$(mktemp tmp.three.XXXX)
+head -c 2000 </dev/urandom >"$TWO"; head -c 4000 </dev/urandom >"$FOUR"; head -c 3000 </dev/urandom >"$THREE"
+"$VFS_EXEC" "$FIMG" mkfs $((22 * 1024)) >/dev/null 2>&1     # 9 free data blocks
+"$VFS_EXEC" "$FIMG" ecpt "$FOUR" /a >/dev/null 2>&1
+"$VFS_EXEC" "$FIMG" ecpt "$ONE" /b >/dev/null 2>&1
+"$VFS_EXEC" "$FIMG" ecpt "$THREE" /c >/dev/null 2>&1
+"$VFS_EXEC" "$FIMG" ecpt "$ONE" /d >/dev/null 2>&1
+"$VFS_EXEC" "$FIMG" rm /b >/dev/null 2>&1
+"$VFS_EXEC" "$FIMG" rm /d >/dev/null 2>&1
+"$VFS_EXEC" "$FIMG" ecpt "$TWO" /e >/dev/null 2>&1          # only the two 1-block gaps left
+"$VFS_EXEC" "$FIMG" frag / | grep -q $'^2\t2\t/e$'
+print_result $? 'frag reports a file split over two gaps' 0
+"$VFS_EXEC" "$FIMG" rm /a >/dev/null 2>&1
+"$VFS_EXEC" "$FIMG" defrag / | grep -q '1 files relocated'
+print_result $? 'defrag relocates the fragmented file' 0
+"$VFS_EXEC" "$FIMG" frag /e | grep -q $'^1\t2\t/e$'
+print_result $? 'file is contiguous after defrag' 0
+"$VFS_EXEC" "$FIMG" ecpf /e "$EXT_OUT" >/dev/null 2>&1 && cmp -s "$TWO" "$EXT_OUT"
+print_result $? 'defragmented file content unchanged' 0
+
+###############################################################################
+# import  (a host tree in one process)
+###############################################################################
+IDIR=$(mktemp -d tmp.tree.XXXX)
+mkdir -p "$IDIR/sub"
+head -c 3000 </dev/urandom >"$IDIR/a"; head -c 5000 </dev/urandom >"$IDIR/sub/b"; echo tiny >"$IDIR/sub/c"
+"$VFS_EXEC" "$FIMG" mkfs "$DISK_SIZE" >/dev/null 2>&1
+"$VFS_EXEC" "$FIMG" mkdir /imp >/dev/null 2>&1
+"$VFS_EXEC" "$FIMG" import -j 2 "$IDIR" /imp | grep -q '3 files, 1 directories'
+print_result $? 'import copies a host tree' 0
+"$VFS_EXEC" "$FIMG" ecpf /imp/sub/b "$EXT_OUT" >/dev/null 2>&1 && cmp -s "$IDIR/sub/b" "$EXT_OUT"
+print_result $? 'imported nested file identical' 0
+"$VFS_EXEC" "$FIMG" import "$IDIR" /imp >/dev/null 2>&1
+print_result $? 'import refuses to overwrite' 1
+mkdir "$IDIR/sub/d"; echo more >"$IDIR/sub/e"   # sub now has 4 entries, its block holds 2
+dfi="$("$VFS_EXEC" "$FIMG" df)"
+"$VFS_EXEC" "$FIMG" mkdir /imp2 >/dev/null 2>&1
+"$VFS_EXEC" "$FIMG" import "$IDIR" /imp2 >/dev/null 2>&1
+print_result $? 'import refuses a tree that does not fit' 1
+[ "$("$VFS_EXEC" "$FIMG" ls /imp2 | grep -c .)" -le 1 ]
+print_result $? 'refused import creates nothing' 0
+"$VFS_EXEC" "$FIMG" rmdir /imp2 >/dev/null 2>&1
+[ "$("$VFS_EXEC" "$FIMG" df)" = "$dfi" ]
+print_result $? 'refused import leaves the counters alone' 0
+rm -rf "$IDIR/sub/d" "$IDIR/sub/e"
+
+# export  (tar stream, hard links stay links)
+"$VFS_EXEC" "$FIMG" crhl /imp/sub/b /lnk >/dev/null 2>&1
+XDIR=$(mktemp -d tmp.x.XXXX)
+"$VFS_EXEC" "$FIMG" export / | tar xf - -C "$XDIR" && diff -r "$IDIR" "$XDIR/imp" >/dev/null
+print_result $? 'export / extracts to the imported tree' 0
+[ "$(stat -c %i "$XDIR/lnk")" = "$(stat -c %i "$XDIR/imp/sub/b")" ]
+print_result $? 'export writes hard links as link entries' 0
+rm -rf "$IDIR" "$XDIR"
+
+# paths of 2.4 KB go into pax headers in full
+IDIR=$(mktemp -d tmp.tree.XXXX); XDIR=$(mktemp -d tmp.x.XXXX); DEEP="$IDIR"
+for i in $(seq 10); do DEEP="$DEEP/$(printf 'd%.0s' $(seq 240))$i"; done
+mkdir -p "$DEEP"; echo deep >"$DEEP/f"
+"$VFS_EXEC" "$FIMG" mkdir /deep >/dev/null 2>&1
+"$VFS_EXEC" "$FIMG" import "$IDIR" /deep >/dev/null 2>&1
+"$VFS_EXEC" "$FIMG" export /deep | tar xf - -C "$XDIR" && diff -r "$IDIR" "$XDIR/deep" >/dev/null
+print_result $? 'export keeps long paths whole' 0
+rm -rf "$IDIR" "$XDIR"
+
+# find  (inode table scan)
+[ "$("$VFS_EXEC" "$FIMG" find -name b -type f | tr '\n' ' ')" = "/imp/sub/b " ]
+print_result $? 'find -name matches by leaf name' 0
+[ "$("$VFS_EXEC" "$FIMG" find -size 4000: | tr '\n' ' ')" = "/imp/sub/b /lnk " ]
+print_result $? 'find -size lists every path of a hard-linked file' 0
+"$VFS_EXEC" "$FIMG" find /imp/sub -dump | grep -Eq '^ +[0-9]+ +f +5000 +2 +5  /imp/sub/b$'
+print_result $? 'find -dump shows inode, type, size, links, blocks' 0
+
+###############################################################################
+# put / get  (streams of unknown length)
+###############################################################################
+"$VFS_EXEC" "$FIMG" mkfs "$DISK_SIZE" >/dev/null 2>&1
+cat "$FIVE" | "$VFS_EXEC" "$FIMG" put -t - /piped >/dev/null 2>&1
+print_result $? 'put reads a pipe' 0
+"$VFS_EXEC" "$FIMG" get /piped - | cmp -s - "$FIVE"
+print_result $? 'get streams the file to stdout' 0
+head -c 13000 /dev/zero | tr '\0' x | "$VFS_EXEC" "$FIMG" put - /big >/dev/null 2>&1
+print_result $? 'put rejects streams over 12 KiB' 1
+num_expect "$(df_field "$("$VFS_EXEC" "$FIMG" df)" 'Used Blocks:')" -eq 18 'rejected put leaves no blocks behind'
+
+###############################################################################
+# checksums  (mkfs ... csum, scrub)
+###############################################################################
+CIMG=tmp.c.img
+"$VFS_EXEC" "$CIMG" mkfs "$DISK_SIZE" csum >/dev/null 2>&1
+"$VFS_EXEC" "$CIMG" mkdir /d >/dev/null 2>&1
+"$VFS_EXEC" "$CIMG" ecpt "$FIVE" /d/f >/dev/null 2>&1
+"$VFS_EXEC" "$CIMG" ext /d/f 2000 >/dev/null 2>&1
+"$VFS_EXEC" "$CIMG" scrub | grep -q ' 0 bad'
+print_result $? 'scrub passes on a clean image' 0
+printf '\001' | dd of="$CIMG" bs=1 seek=$((12 * 1024 + 300)) conv=notrunc 2>/dev/null  # root dir block
+"$VFS_EXEC" "$CIMG" ls / 2>&1 | grep -q 'block 12: checksum mismatch'
+print_result $? 'corrupt directory block is detected on read' 0
+"$VFS_EXEC" "$CIMG" scrub >/dev/null 2>&1
+print_result $? 'scrub fails on a corrupt image' 1
+"$VFS_EXEC" "$CIMG" clone-compact tmp.c2.img >/dev/null 2>&1
+print_result $? 'clone-compact refuses a corrupt source' 1
+
+###############################################################################
+# discard / clone-compact
+###############################################################################
+GIMG=tmp.g.img
+"$VFS_EXEC" "$GIMG" mkfs "$DISK_SIZE" discard csum >/dev/null 2>&1
+"$VFS_EXEC" "$GIMG" ecpt "$FIVE" /a >/dev/null 2>&1
+"$VFS_EXEC" "$GIMG" ecpt "$FIVE" /b >/dev/null 2>&1
+"$VFS_EXEC" --stats=json "$GIMG" rm /a 2>&1 >/dev/null | grep -q '"discards":5,'
+print_result $? 'rm punches the freed blocks out of the image' 0
+"$VFS_EXEC" "$GIMG" clone-compact tmp.g2.img dense >/dev/null 2>&1
+print_result $? 'clone-compact dense' 0
+"$VFS_EXEC" tmp.g2.img ecpf /b "$EXT_OUT" >/dev/null 2>&1 && cmp -s "$FIVE" "$EXT_OUT"
+print_result $? 'file intact in the dense clone' 0
+"$VFS_EXEC" tmp.g2.img scrub | grep -q ' 0 bad'
+print_result $? 'dense clone checksums are valid' 0
+num_expect "$(du -k tmp.g2.img | cut -f1)" -lt 100 'clone only stores allocated blocks'
+ln -s "$GIMG" tmp.g3.img
+"$VFS_EXEC" "$GIMG" clone-compact tmp.g3.img >/dev/null 2>&1
+print_result $? 'clone-compact refuses to overwrite its source' 1
+"$VFS_EXEC" "$GIMG" ecpf /b "$EXT_OUT" >/dev/null 2>&1 && cmp -s "$FIVE" "$EXT_OUT"
+print_result $? 'source intact after refused clone' 0
+
+###############################################################################
+# send / receive  (mkfs ... changemap)
+###############################################################################
+SIMG=tmp.s.img
+"$VFS_EXEC" "$SIMG" mkfs "$DISK_SIZE" changemap >/dev/null 2>&1
+"$VFS_EXEC" "$SIMG" ecpt "$FIVE" /a >/dev/null 2>&1
+cp "$SIMG" tmp.s0.img
+gen=$(df_field "$("$VFS_EXEC" "$SIMG" df)" 'Generation:')
+"$VFS_EXEC" "$SIMG" ecpt "$ONE" /b >/dev/null 2>&1
+"$VFS_EXEC" "$SIMG" rm /a >/dev/null 2>&1
+num_expect "$(df_field "$("$VFS_EXEC" "$SIMG" df)" 'Generation:')" -eq $((gen + 2)) 'every writing command bumps the generation'
+"$VFS_EXEC" "$SIMG" frag / >/dev/null 2>&1
+num_expect "$(df_field "$("$VFS_EXEC" "$SIMG" df)" 'Generation:')" -eq $((gen + 2)) 'frag leaves the generation alone'
+"$VFS_EXEC" "$SIMG" send --since "$gen" tmp.s.send | grep -q ' of '
+print_result $? 'send writes the changed blocks' 0
+num_expect "$(stat -c %s tmp.s.send)" -lt $((DISK_SIZE / 10)) 'send stream is proportional to the change'
+"$VFS_EXEC" tmp.s0.img receive tmp.s.send >/dev/null 2>&1 && cmp -s "$SIMG" tmp.s0.img
+print_result $? 'receive brings the old copy up to date' 0
+"$VFS_EXEC" "$SIMG" ecpt "$ONE" /c >/dev/null 2>&1
+"$VFS_EXEC" "$SIMG" send --since $((gen + 3)) | "$VFS_EXEC" tmp.s0.img receive >/dev/null 2>&1
+print_result $? 'receive refuses a stream with a gap' 1
+"$VFS_EXEC" tmp.s0.img mkdir /local >/dev/null 2>&1
+"$VFS_EXEC" "$SIMG" send --since $((gen + 3)) | "$VFS_EXEC" tmp.s0.img receive >/dev/null 2>&1
+print_result $? 'receive refuses a copy with writes of its own' 1
+# a plain copy that wrote once is at the same generation as the sender was
+cp "$SIMG" tmp.s2.img
+gen=$(df_field "$("$VFS_EXEC" "$SIMG" df)" 'Generation:')
+"$VFS_EXEC" tmp.s2.img mkdir /local >/dev/null 2>&1
+"$VFS_EXEC" "$SIMG" ecpt "$ONE" /e >/dev/null 2>&1
+"$VFS_EXEC" "$SIMG" rm /e >/dev/null 2>&1
+"$VFS_EXEC" "$SIMG" send --since $((gen + 1)) | "$VFS_EXEC" tmp.s2.img receive >/dev/null 2>&1
+print_result $? 'receive refuses a copy that diverged at the same generation' 1
+"$VFS_EXEC" tmp.s2.img ls /local >/dev/null 2>&1
+print_result $? 'diverged copy keeps its own writes' 0
+"$VFS_EXEC" "$SIMG" clone-compact tmp.s1.img dense >/dev/null 2>&1
+gen=$(df_field "$("$VFS_EXEC" "$SIMG" df)" 'Generation:')
+"$VFS_EXEC" "$SIMG" ecpt "$ONE" /d >/dev/null 2>&1
+"$VFS_EXEC" "$SIMG" send --since "$gen" | "$VFS_EXEC" tmp.s1.img receive >/dev/null 2>&1
+print_result $? 'receive refuses a dense clone, its blocks are renumbered' 1
+"$VFS_EXEC" "$SIMG" send --since 1x >/dev/null 2>&1
+print_result $? 'send rejects a malformed generation' 1
+
+###############################################################################
+# --stats
+###############################################################################
+st=$("$VFS_EXEC" --stats=json "$IMAGE" ls / 2>&1 >/dev/null)
+printf '%s\n' "$st" | grep -q '"command":"ls".*"block_reads":[1-9]'
+print_result $? 'stats json counts block reads' 0
+PROM=$(mktemp tmp.prom.XXXX)
+"$VFS_EXEC" --stats=prom:"$PROM" "$IMAGE" df >/dev/null 2>&1
+grep -q '^vfs_read_calls_total{command="df"} [1-9]' "$PROM"
+print_result $? 'stats prom textfile written' 0
+"$VFS_EXEC" --stats=promx "$IMAGE" df >/dev/null 2>&1
+print_result $? 'unknown stats format is rejected' 1
+"$VFS_EXEC" --stats=json "$IMAGE" 'x"y' 2>&1 >/dev/null | grep -q '"command":"x\\"y"'
+print_result $? 'stats json escapes the command name' 0
+
+###############################################################################
+# --trace + vfs-replay
+###############################################################################
+TRACE=$(mktemp tmp.trace.XXXX); HOSTF=$(mktemp tmp.host.XXXX)
+echo "traced" >"$HOSTF"
+VFS_TRACE="$TRACE" "$VFS_EXEC" "$IMAGE" mkdir /traced     >/dev/null 2>&1
+"$VFS_EXEC" --trace="$TRACE" "$IMAGE" ecpt "$HOSTF" /traced/f >/dev/null 2>&1
+"$VFS_EXEC" --trace="$TRACE" "$IMAGE" mkdir /traced   >/dev/null 2>&1   # fails, recorded as such
+./vfs-replay -d "$TRACE" | grep -q 'wb'
+print_result $? 'trace records block writes' 0
+./vfs-replay -m "$DISK_SIZE" "$TRACE" tmp.replay.img >/dev/null 2>&1
+print_result $? 'replay on fresh image matches recorded status' 0
+# first record claims 9 arguments (argc sits 24 bytes into the record)
+cp "$TRACE" tmp.badtrace; printf '\011\000' | dd of=tmp.badtrace bs=1 seek=24 conv=notrunc 2>/dev/null
+./vfs-replay -d tmp.badtrace >/dev/null 2>&1
+print_result $? 'replay rejects a record whose argc does not match' 1
+
 ###############################################################################
 echo
 printf 'Summary: %d passed – %d failed\n' "$PASS" "$FAIL"
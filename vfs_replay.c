@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "vfs_trace.h"
+
+// replays a trace recorded with `vfs --trace=<file>` against another image,
+// one vfs process per record, and reports throughput and latency percentiles
+
+typedef struct
+{
+    TraceRecord rec;
+    char **argv; // NULL terminated, argv[0] = command name
+} Op;
+
+void die(const char *msg)
+{
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// points argv at the argc NUL-terminated strings that make up exactly
+// bytes bytes of args; false for a record that doesn't add up
+bool split_args(char *args, uint32_t bytes, uint32_t argc, char **argv)
+{
+    uint32_t off = 0;
+    for (uint32_t i = 0; i < argc; i++) {
+        if (off >= bytes)
+            return false;
+        size_t len = strnlen(args + off, bytes - off);
+        if (len == bytes - off) // no NUL before the end
+            return false;
+        argv[i] = args + off;
+        off += len + 1;
+    }
+    return off == bytes;
+}
+
+Op *load_trace(const char *path, uint32_t *count)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) die("open trace");
+
+    Op *ops = NULL;
+    uint32_t n = 0, cap = 0;
+    TraceRecord rec;
+
+    while (fread(&rec, sizeof rec, 1, fp) == 1) {
+        if (rec.magic != TRACE_MAGIC) {
+            fprintf(stderr, "replay: bad record at op %u\n", n);
+            exit(EXIT_FAILURE);
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            ops = realloc(ops, cap * sizeof *ops);
+            if (!ops) die("realloc");
+        }
+
+        char *args = malloc(rec.argBytes + 1);
+        char **argv = calloc(rec.argc + 1, sizeof *argv);
+        if (!args || !argv) die("malloc");
+        if (fread(args, 1, rec.argBytes, fp) != rec.argBytes) die("truncated trace");
+        if (!rec.argc || !split_args(args, rec.argBytes, rec.argc, argv)) {
+            fprintf(stderr, "replay: bad arguments at op %u\n", n);
+            exit(EXIT_FAILURE);
+        }
+
+        // the block/inode I/O is only needed by -d, skip it otherwise
+        if (fseek(fp, (long)rec.ioCount * sizeof(TraceIo), SEEK_CUR)) die("seek trace");
+
+        ops[n].rec = rec;
+        ops[n].argv = argv;
+        n++;
+    }
+
+    fclose(fp);
+    *count = n;
+    return ops;
+}
+
+void dump_trace(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) die("open trace");
+
+    TraceRecord rec;
+    char args[UINT16_MAX + 1];
+    static char *argv[UINT16_MAX];
+    const char *names[] = {"ri", "wi", "rb", "wb"};
+
+    while (fread(&rec, sizeof rec, 1, fp) == 1) {
+        if (rec.magic != TRACE_MAGIC) { fprintf(stderr, "replay: bad record\n"); exit(EXIT_FAILURE); }
+        if (fread(args, 1, rec.argBytes, fp) != rec.argBytes) die("truncated trace");
+        if (!split_args(args, rec.argBytes, rec.argc, argv)) { fprintf(stderr, "replay: bad arguments\n"); exit(EXIT_FAILURE); }
+
+        printf("%llu.%09llu %8.3f ms  status %d ",
+               (unsigned long long)(rec.startNs / 1000000000ull),
+               (unsigned long long)(rec.startNs % 1000000000ull),
+               rec.durationNs / 1e6, rec.status);
+        for (uint32_t i = 0; i < rec.argc; i++)
+            printf(" %s", argv[i]);
+        printf("\n   io:");
+        for (uint32_t i = 0; i < rec.ioCount; i++) {
+            TraceIo io;
+            if (fread(&io, sizeof io, 1, fp) != 1) die("truncated trace");
+            printf(" %s%u", io.op < 4 ? names[io.op] : "??", io.no);
+        }
+        printf("\n");
+    }
+    fclose(fp);
+}
+
+int run_op(const char *vfs, const char *img, Op *op)
+{
+    pid_t pid = fork();
+    if (pid < 0) die("fork");
+
+    if (pid == 0) {
+        char **argv = calloc(op->rec.argc + 3, sizeof *argv);
+        if (!argv) _exit(127);
+        argv[0] = (char *)vfs;
+        argv[1] = (char *)img;
+        for (uint32_t i = 0; i < op->rec.argc; i++)
+            argv[i + 2] = op->argv[i];
+
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        unsetenv("VFS_TRACE"); // don't record the replay into the trace it reads
+        execv(vfs, argv);
+        _exit(127);
+    }
+
+    int st;
+    if (waitpid(pid, &st, 0) < 0) die("waitpid");
+    return WIFEXITED(st) ? WEXITSTATUS(st) : 128;
+}
+
+int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+double pct(uint64_t *sorted, uint32_t n, double p)
+{
+    uint32_t i = (uint32_t)(p * (n - 1) + 0.5);
+    return sorted[i] / 1e6;
+}
+
+void usage()
+{
+    printf("Usage: vfs-replay [-p] [-x <vfs>] [-m <bytes>] <trace> <imagepath>\n");
+    printf("       vfs-replay -d <trace>\n");
+    printf("\t-p\t\t- keep the recorded pacing between commands\n");
+    printf("\t-x <vfs>\t- vfs binary to run (default ./vfs)\n");
+    printf("\t-m <bytes>\t- mkfs a fresh image before replaying\n");
+    printf("\t-d\t\t- dump the trace as text\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *vfs = "./vfs";
+    const char *mkfs_bytes = NULL;
+    bool paced = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "px:m:d")) != -1) {
+        switch (opt) {
+        case 'p': paced = true; break;
+        case 'x': vfs = optarg; break;
+        case 'm': mkfs_bytes = optarg; break;
+        case 'd':
+            if (optind != argc - 1) { usage(); return 1; }
+            dump_trace(argv[optind]);
+            return 0;
+        default: usage(); return 1;
+        }
+    }
+    if (optind != argc - 2) {
+        usage();
+        return 1;
+    }
+
+    const char *trace = argv[optind];
+    const char *img = argv[optind + 1];
+
+    uint32_t n;
+    Op *ops = load_trace(trace, &n);
+    if (!n) {
+        fprintf(stderr, "replay: empty trace\n");
+        return 1;
+    }
+
+    if (mkfs_bytes) {
+        char *mk[] = {"mkfs", (char *)mkfs_bytes, NULL};
+        Op op = {.rec = {.argc = 2}, .argv = mk};
+        if (run_op(vfs, img, &op) != 0) {
+            fprintf(stderr, "replay: mkfs failed\n");
+            return 1;
+        }
+    }
+
+    uint64_t *lat = malloc(n * sizeof *lat);
+    if (!lat) die("malloc");
+    uint32_t mismatches = 0;
+    uint64_t rec_ns = 0;
+
+    uint64_t start = now_ns();
+    for (uint32_t i = 0; i < n; i++) {
+        if (paced) {
+            // sleep until the op's recorded offset from the first op
+            uint64_t due = start + (ops[i].rec.startNs - ops[0].rec.startNs);
+            uint64_t t = now_ns();
+            if (due > t) {
+                struct timespec ts = {(time_t)((due - t) / 1000000000ull),
+                                      (long)((due - t) % 1000000000ull)};
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        uint64_t t0 = now_ns();
+        int st = run_op(vfs, img, &ops[i]);
+        lat[i] = now_ns() - t0;
+        rec_ns += ops[i].rec.durationNs;
+
+        if (st != ops[i].rec.status) {
+            mismatches++;
+            fprintf(stderr, "replay: op %u (%s) exited %d, recorded %d\n",
+                    i, ops[i].argv[0], st, ops[i].rec.status);
+        }
+    }
+    double wall = (now_ns() - start) / 1e9;
+
+    qsort(lat, n, sizeof *lat, cmp_u64);
+    printf("ops:          %u (%u status mismatches)\n", n, mismatches);
+    printf("wall time:    %.3f s%s\n", wall, paced ? " (paced)" : "");
+    printf("throughput:   %.1f ops/s\n", n / wall);
+    printf("latency ms:   p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+           pct(lat, n, 0.50), pct(lat, n, 0.90), pct(lat, n, 0.99), lat[n - 1] / 1e6);
+    printf("recorded:     %.3f ms total in-command time\n", rec_ns / 1e6);
+
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,43 @@
+#ifndef VFS_TRACE_H
+#define VFS_TRACE_H
+
+#include <stdint.h>
+
+// binary workload trace shared by vfs (--trace / VFS_TRACE) and vfs-replay
+//
+// the trace file is a plain sequence of records, one per vfs invocation:
+//   TraceRecord | argBytes of NUL-separated arguments | ioCount * TraceIo
+// arguments start at the command name (the image path is not recorded, the
+// replay substitutes its own). each record is appended with a single write(),
+// so concurrent invocations sharing one trace file never interleave
+
+#define TRACE_MAGIC 0x31525456u // "VTR1"
+
+enum
+{
+    TRACE_READ_INODE,
+    TRACE_WRITE_INODE,
+    TRACE_READ_BLOCK,
+    TRACE_WRITE_BLOCK,
+};
+
+#pragma pack(push, 1)
+typedef struct
+{
+    uint32_t magic;
+    uint64_t startNs;    // wall clock (CLOCK_REALTIME) at command start
+    uint64_t durationNs;
+    int32_t status;      // exit status of the command
+    uint16_t argc;
+    uint16_t argBytes;
+    uint32_t ioCount;
+} TraceRecord;
+
+typedef struct
+{
+    uint8_t op;  // TRACE_*
+    uint32_t no; // inode or block number
+} TraceIo;
+#pragma pack(pop)
+
+#endif
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // SEEK_DATA / SEEK_HOLE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -8,6 +10,16 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <sys/random.h>
+#include <dirent.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "vfs_trace.h"
 
 #define BLOCKSIZE 1024
 #define DIRECTBLOCK_CNT 12
@@ -24,8 +36,38 @@
 #define INODE_TABLE_OFFSET (INODE_BITMAP_OFFSET + BLOCKSIZE)
 #define DATA_BLOCKS_OFFSET (INODE_TABLE_OFFSET + INODE_TABLE_BLOCKS * BLOCKSIZE)
 #define DIRS_PER_BLOCK (BLOCKSIZE / sizeof(DirectoryEntry))
+#define INLINE_MAX (DIRECTBLOCK_CNT * sizeof(uint32_t)) // file bytes that fit in directPointers
+#define HOLE 0 // directPointers value of a block that was never written, reads as zeros
+
+// Inode.flags
+#define INODE_INLINE 0x01 // data lives in directPointers, no blocks allocated
+#define INODE_COMPRESSED 0x02 // data stored as clusters, see clusterMap
+
+// compression clusters: 4 logical blocks each, so a 12 KiB file has 3 and
+// their nibbles fit in Inode.clusterMap (low 3 bits block count, bit 3 packed)
+#define CLUSTER_BLOCKS 4
+#define CLUSTER_CNT (DIRECTBLOCK_CNT / CLUSTER_BLOCKS)
+#define CLUSTER_BYTES (CLUSTER_BLOCKS * BLOCKSIZE)
+#define CLUSTER_COUNT_MASK 0x7
+#define CLUSTER_PACKED 0x8
+
+// SuperBlock.featureFlags
+#define FEATURE_COMPRESS 0x01 // ecpt compresses every new file
+#define FEATURE_DEDUP 0x02 // identical data blocks are stored once
+#define FEATURE_CSUM 0x04 // CRC32C of every block, verified on read
+#define FEATURE_DISCARD 0x08 // freed blocks are punched out of the image file
+#define FEATURE_CHANGEMAP 0x10 // generation of the last write of every block, for send
+
+// SuperBlock.genTags: how many recent generations a send can start from
+#define GEN_HISTORY 64
 
 #pragma pack(push, 1) // tight packing of structures
+typedef struct
+{
+    uint32_t generation;
+    uint32_t tag; // random, drawn when the generation is made
+} GenTag;
+
 typedef struct
 {
     uint32_t totalBlockCount;
@@ -34,6 +76,19 @@ typedef struct
     uint32_t freeBlockCount;
     uint32_t blockSize; // for compatibility
     uint32_t dataStartOffset;
+    uint32_t featureFlags; // FEATURE_*, 0 on images made before features existed
+    uint32_t refcountStart; // per-block share counts, 0 blocks = none shared
+    uint32_t refcountBlocks;
+    uint32_t dedupIndexStart; // content hash -> block, FEATURE_DEDUP
+    uint32_t dedupIndexBlocks;
+    uint32_t csumStart; // FEATURE_CSUM: one CRC32C per block
+    uint32_t csumBlocks;
+    uint32_t superCsum; // CRC32C of this struct with this field 0
+    uint32_t generation; // FEATURE_CHANGEMAP: bumped by every command that writes
+    uint32_t genmapStart; // generation of the last write, one per block
+    uint32_t genmapBlocks;
+    uint64_t lineage; // random at mkfs, shared by every copy of the image
+    GenTag genTags[GEN_HISTORY]; // by generation % GEN_HISTORY; copies that wrote on their own differ here
 } SuperBlock;
 
 typedef struct
@@ -42,7 +97,9 @@ typedef struct
     uint32_t directPointers[DIRECTBLOCK_CNT]; // to data blocks
     uint32_t linkCount;
     uint32_t isDirectory; // 0 - file, 1 -dir
-    uint8_t padding[4]; // make struct 64 bytes
+    uint8_t flags; // INODE_*
+    uint16_t clusterMap; // INODE_COMPRESSED: one nibble per cluster
+    uint8_t padding[1]; // make struct 64 bytes
 
 } Inode;
 typedef struct
@@ -64,12 +121,72 @@ typedef struct
 
 SuperBlock sb; //static for simplicity
 
+// latency histogram buckets: bucket i counts calls that took < 2^i microseconds,
+// the last one is the +Inf overflow bucket
+#define STATS_HIST_BUCKETS 18
+
+// I/O counters of the current command, filled by read_at/write_at and the
+// inode/block helpers on top of them; printed at exit with --stats
+typedef struct
+{
+    uint64_t readCalls;
+    uint64_t readBytes;
+    uint64_t writeCalls;
+    uint64_t writeBytes;
+    uint64_t seeks;       // accesses not starting where the previous one ended
+    uint64_t inodeReads;
+    uint64_t inodeWrites;
+    uint64_t blockReads;
+    uint64_t blockWrites;
+    uint64_t dedupHits;
+    uint64_t cacheHits;   // metadata accesses served from memory in bulk mode
+    uint64_t csumVerifies; // blocks checked against their checksum
+    uint64_t discards;     // freed blocks punched out of the image file
+    uint64_t latency[STATS_HIST_BUCKETS]; // per read_at/write_at call
+    uint64_t latencySumNs;
+} IoStats;
+
+IoStats stats;
+uint64_t stats_pos = UINT64_MAX; // image offset right after the last access
+bool stats_timed = false;        // only pay for clock_gettime when someone looks
+
+// --trace / VFS_TRACE: block and inode I/O of the command, appended to the trace at exit
+int trace_fd = -1;
+TraceIo *trace_ios = NULL;
+uint32_t trace_io_cnt = 0, trace_io_cap = 0;
+
+int exit_status = 0; // what the process is about to exit with, for the trace
+
+void bulk_end(void);
+
 void die(const char *msg)
 {
     perror(msg);
+    bulk_end();
+    exit_status = EXIT_FAILURE;
     exit(EXIT_FAILURE);
 }
 
+void trace_io(uint8_t op, uint32_t no)
+{
+    if (trace_fd < 0)
+        return;
+    if (trace_io_cnt == trace_io_cap) {
+        uint32_t cap = trace_io_cap ? trace_io_cap * 2 : 256;
+        TraceIo *ios = realloc(trace_ios, cap * sizeof *ios);
+        if (!ios) { // drop the trace rather than fail the command
+            close(trace_fd);
+            trace_fd = -1;
+            return;
+        }
+        trace_ios = ios;
+        trace_io_cap = cap;
+    }
+    trace_ios[trace_io_cnt].op = op;
+    trace_ios[trace_io_cnt].no = no;
+    trace_io_cnt++;
+}
+
 FILE *open_image_rw(const char *path)
 {
     FILE *fp = fopen(path, "r+b");
@@ -78,27 +195,400 @@ FILE *open_image_rw(const char *path)
     return fp;
 }
 
+// for commands that must not change the image
+FILE *open_image_ro(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        die("open");
+    return fp;
+}
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_account(uint64_t off, size_t n, uint64_t t0)
+{
+    if (off != stats_pos)
+        stats.seeks++;
+    stats_pos = off + n;
+
+    if (!stats_timed)
+        return;
+
+    uint64_t ns = now_ns() - t0;
+    uint32_t b = 0;
+    while (b < STATS_HIST_BUCKETS - 1 && ns >= (1000ull << b))
+        b++;
+    stats.latency[b]++;
+    stats.latencySumNs += ns;
+}
+
+// ---------------------------------------------------------------------------
+// checksums (FEATURE_CSUM): a CRC32C per block in the table at csumStart,
+// the superblock carries its own. write_at keeps the table current and
+// read_at verifies every block the first time the command touches it
+// ---------------------------------------------------------------------------
+uint32_t crc32c_table[256];
+bool crc32c_use_hw = false;
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// once per process, scrub threads may get here at the same time
+void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c >> 1) ^ (c & 1 ? 0x82F63B78u : 0);
+        crc32c_table[i] = c;
+    }
+#if defined(__x86_64__)
+    crc32c_use_hw = __builtin_cpu_supports("sse4.2") && !getenv("VFS_CRC32C_SW");
+#endif
+}
+
+uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t n)
+{
+    while (n--)
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t n)
+{
+    uint64_t c = crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    while (n--)
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    return (uint32_t)c;
+}
+#endif
+
+// the SSE4.2 crc32 instruction when the CPU has it, a table otherwise
+uint32_t crc32c(const void *buf, size_t n)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+#if defined(__x86_64__)
+    if (crc32c_use_hw)
+        return ~crc32c_hw(~0u, buf, n);
+#endif
+    return ~crc32c_sw(~0u, buf, n);
+}
+
+uint32_t *csum_table = NULL;      // the whole table, loaded with the superblock
+uint8_t csum_seen[BLOCKSIZE];     // one bit per block: verified or written already
+
+// plain I/O for the checksum code itself, which must not recurse into read_at/write_at
+void raw_read(FILE *fp, uint64_t off, void *buf, size_t n)
+{
+    if (fseek(fp, off, SEEK_SET) || fread(buf, 1, n, fp) != n)
+        die("read_at");
+    stats.readCalls++;
+    stats.readBytes += n;
+}
+
+void raw_write(FILE *fp, uint64_t off, const void *buf, size_t n)
+{
+    if (fseek(fp, off, SEEK_SET) || fwrite(buf, 1, n, fp) != n)
+        die("write_at");
+    stats.writeCalls++;
+    stats.writeBytes += n;
+}
+
+// block 0 has superCsum, the table can't contain itself, and the change
+// map is written around write_at like the table
+bool csum_covers(uint32_t blk)
+{
+    return blk && blk < sb.totalBlockCount &&
+           (blk < sb.csumStart || blk >= sb.csumStart + sb.csumBlocks) &&
+           (blk < sb.genmapStart || blk >= sb.genmapStart + sb.genmapBlocks);
+}
+
+// change map (FEATURE_CHANGEMAP): the first write of a command bumps
+// sb.generation, and every block written gets stamped with it. the map's own
+// blocks are stamped when their entries change, so a send of everything
+// newer than some generation carries the map along
+uint32_t *gen_table = NULL; // the whole map, loaded with the superblock
+bool gen_bumped = false;
+
+void random_fill(void *buf, size_t n)
+{
+    if (getrandom(buf, n, 0) != (ssize_t)n)
+        die("getrandom");
+}
+
+void store_super(FILE *fp);
+
+// two copies at the same generation hold the same blocks only if they made
+// it from the same writes, which they did if its tags match
+void gen_new(void)
+{
+    GenTag *t = &sb.genTags[sb.generation % GEN_HISTORY];
+    t->generation = sb.generation;
+    random_fill(&t->tag, sizeof t->tag);
+}
+
+// false once the generation has dropped out of the history
+bool gen_tag(uint32_t gen, uint32_t *tag)
+{
+    const GenTag *t = &sb.genTags[gen % GEN_HISTORY];
+    *tag = t->tag;
+    return t->generation == gen;
+}
+
+void gen_stamp(FILE *fp, uint64_t off, size_t n)
+{
+    if (!gen_bumped) {
+        gen_bumped = true;
+        sb.generation++;
+        gen_new();
+        store_super(fp); // stamps block 0 through here
+    }
+
+    uint32_t first = off / BLOCKSIZE, last = (off + n - 1) / BLOCKSIZE;
+    if (last >= sb.totalBlockCount)
+        last = sb.totalBlockCount - 1;
+    bool changed = false;
+    for (uint32_t b = first; b <= last; b++)
+        if (gen_table[b] != sb.generation) {
+            gen_table[b] = sb.generation;
+            changed = true;
+        }
+    if (!changed) // rewrites of a block within one command cost nothing
+        return;
+
+    uint64_t toff = (uint64_t)sb.genmapStart * BLOCKSIZE + first * sizeof *gen_table;
+    size_t tlen = (last - first + 1) * sizeof *gen_table;
+    raw_write(fp, toff, gen_table + first, tlen);
+
+    for (uint32_t tb = toff / BLOCKSIZE; tb <= (toff + tlen - 1) / BLOCKSIZE; tb++)
+        if (gen_table[tb] != sb.generation) {
+            gen_table[tb] = sb.generation;
+            raw_write(fp, (uint64_t)sb.genmapStart * BLOCKSIZE + tb * sizeof *gen_table,
+                      gen_table + tb, sizeof *gen_table);
+        }
+}
+
+// checks the blocks under [off, off + n) that this command hasn't seen yet;
+// buf holds what was just read from there
+void csum_verify(FILE *fp, uint64_t off, const uint8_t *buf, size_t n)
+{
+    uint8_t tmp[BLOCKSIZE];
+    for (uint32_t b = off / BLOCKSIZE; (uint64_t)b * BLOCKSIZE < off + n; b++) {
+        if (!csum_covers(b) || (csum_seen[b / 8] & (1 << (b & 7))))
+            continue;
+        uint64_t boff = (uint64_t)b * BLOCKSIZE;
+        const uint8_t *data = buf + (boff - off);
+        if (boff < off || boff + BLOCKSIZE > off + n) {
+            raw_read(fp, boff, tmp, BLOCKSIZE);
+            data = tmp;
+        }
+        stats.csumVerifies++;
+        if (crc32c(data, BLOCKSIZE) != csum_table[b]) {
+            fprintf(stderr, "block %u: checksum mismatch\n", b);
+            errno = EIO;
+            die("read_at");
+        }
+        csum_seen[b / 8] |= 1 << (b & 7);
+    }
+}
+
+// recomputes the checksums of the blocks under a write that just happened
+void csum_update(FILE *fp, uint64_t off, const uint8_t *buf, size_t n)
+{
+    uint8_t tmp[BLOCKSIZE];
+    uint32_t first = off / BLOCKSIZE, last = (off + n - 1) / BLOCKSIZE;
+    for (uint32_t b = first; b <= last; b++) {
+        if (!csum_covers(b))
+            continue;
+        uint64_t boff = (uint64_t)b * BLOCKSIZE;
+        const uint8_t *data = buf + (boff - off);
+        if (boff < off || boff + BLOCKSIZE > off + n) {
+            raw_read(fp, boff, tmp, BLOCKSIZE); // partial write, the rest is on disk
+            data = tmp;
+        }
+        csum_table[b] = crc32c(data, BLOCKSIZE);
+        csum_seen[b / 8] |= 1 << (b & 7);
+    }
+    uint64_t toff = (uint64_t)sb.csumStart * BLOCKSIZE + first * sizeof *csum_table;
+    raw_write(fp, toff, csum_table + first, (last - first + 1) * sizeof *csum_table);
+    if (gen_table)
+        gen_stamp(fp, toff, (last - first + 1) * sizeof *csum_table);
+}
+
+// bulk mode (import): the BGDT, both bitmaps and the inode table are kept in
+// meta_cache and written back once by bulk_end(), and consecutive
+// write_block()s are gathered in run_buf and written with one call
+#define RUN_MAX_BLOCKS 256
+
+FILE *bulk_fp = NULL;
+uint8_t *meta_cache = NULL;
+uint64_t meta_dirty_lo = UINT64_MAX, meta_dirty_hi = 0;
+uint8_t *run_buf = NULL;
+uint32_t run_start = 0, run_len = 0; // pending run [start, start + len)
+
+void write_at(FILE *fp, uint64_t off, const void *buf, size_t n);
+
+bool meta_cached(uint64_t off, size_t n)
+{
+    return meta_cache && off >= BGDT_OFFSET && off + n <= DATA_BLOCKS_OFFSET;
+}
+
+void run_flush(FILE *fp)
+{
+    uint32_t len = run_len;
+    run_len = 0; // write_at below must not flush again
+    if (len)
+        write_at(fp, (uint64_t)run_start * BLOCKSIZE, run_buf, (size_t)len * BLOCKSIZE);
+}
+
+// any other access to the pending run has to see it on disk
+void run_check(FILE *fp, uint64_t off, size_t n)
+{
+    uint64_t lo = (uint64_t)run_start * BLOCKSIZE, hi = lo + (uint64_t)run_len * BLOCKSIZE;
+    if (run_len && off < hi && off + n > lo)
+        run_flush(fp);
+}
+
 void read_at(FILE *fp, uint64_t off, void *buf, size_t n)
 {
+    if (meta_cached(off, n)) {
+        memcpy(buf, meta_cache + off - BGDT_OFFSET, n);
+        stats.cacheHits++;
+        return;
+    }
+    run_check(fp, off, n);
+
+    uint64_t t0 = stats_timed ? now_ns() : 0;
     if (fseek(fp, off, SEEK_SET) || fread(buf, 1, n, fp) != n)
         die("read_at");
-        
+    stats.readCalls++;
+    stats.readBytes += n;
+    stats_account(off, n, t0);
+    if (csum_table)
+        csum_verify(fp, off, buf, n);
 }
 
 void write_at(FILE *fp, uint64_t off, const void *buf, size_t n)
 {
+    if (meta_cached(off, n)) {
+        memcpy(meta_cache + off - BGDT_OFFSET, buf, n);
+        if (off < meta_dirty_lo) meta_dirty_lo = off;
+        if (off + n > meta_dirty_hi) meta_dirty_hi = off + n;
+        stats.cacheHits++;
+        return;
+    }
+    run_check(fp, off, n);
+
+    uint64_t t0 = stats_timed ? now_ns() : 0;
     if (fseek(fp, off, SEEK_SET) || fwrite(buf, 1, n, fp) != n)
         die("write_at");
+    stats.writeCalls++;
+    stats.writeBytes += n;
+    stats_account(off, n, t0);
+    if (csum_table)
+        csum_update(fp, off, buf, n);
+    if (gen_table)
+        gen_stamp(fp, off, n);
+}
+
+void bulk_begin(FILE *fp)
+{
+    meta_cache = malloc(DATA_BLOCKS_OFFSET - BGDT_OFFSET);
+    run_buf = malloc(RUN_MAX_BLOCKS * BLOCKSIZE);
+    if (!meta_cache || !run_buf)
+        die("malloc");
+    uint8_t *c = meta_cache;
+    meta_cache = NULL; // the fill itself goes to the image
+    read_at(fp, BGDT_OFFSET, c, DATA_BLOCKS_OFFSET - BGDT_OFFSET);
+    meta_cache = c;
+    bulk_fp = fp;
+}
+
+// data first, then the metadata pointing at it and the superblock whose
+// counters match it; also called from die(), so a failed import leaves the
+// image as consistent as a failed ecpt would
+void bulk_end(void)
+{
+    FILE *fp = bulk_fp;
+    if (!fp)
+        return;
+    bulk_fp = NULL;
+    run_flush(fp);
+    free(run_buf);
+    run_buf = NULL;
+
+    uint8_t *c = meta_cache;
+    meta_cache = NULL;
+    if (meta_dirty_lo < meta_dirty_hi)
+        write_at(fp, meta_dirty_lo, c + meta_dirty_lo - BGDT_OFFSET, meta_dirty_hi - meta_dirty_lo);
+    meta_dirty_lo = UINT64_MAX;
+    meta_dirty_hi = 0;
+    free(c);
+    store_super(fp);
 }
 
 // superblock
+// a per-block table of uint32 must hold an entry for every block and lie
+// inside the image
+void check_table(uint32_t start, uint32_t blocks)
+{
+    if ((uint64_t)blocks * BLOCKSIZE / sizeof(uint32_t) < sb.totalBlockCount ||
+        !start || (uint64_t)start + blocks > sb.totalBlockCount) {
+        errno = EIO;
+        die("superblock: bad table location");
+    }
+}
+
 void load_super(FILE *fp)
 {
     read_at(fp, 0, &sb, sizeof sb);
+
+    // the tables are only trusted once the superblock pointing at them is
+    if (sb.featureFlags & FEATURE_CSUM) {
+        uint32_t stored = sb.superCsum;
+        sb.superCsum = 0;
+        if (crc32c(&sb, sizeof sb) != stored) {
+            errno = EIO;
+            die("superblock checksum mismatch");
+        }
+        sb.superCsum = stored;
+
+        check_table(sb.csumStart, sb.csumBlocks);
+        free(csum_table);
+        csum_table = malloc((size_t)sb.csumBlocks * BLOCKSIZE);
+        if (!csum_table)
+            die("malloc");
+        raw_read(fp, (uint64_t)sb.csumStart * BLOCKSIZE, csum_table, (size_t)sb.csumBlocks * BLOCKSIZE);
+        memset(csum_seen, 0, sizeof csum_seen);
+    }
+
+    if (sb.featureFlags & FEATURE_CHANGEMAP) {
+        check_table(sb.genmapStart, sb.genmapBlocks);
+        free(gen_table);
+        gen_table = malloc((size_t)sb.genmapBlocks * BLOCKSIZE);
+        if (!gen_table)
+            die("malloc");
+        raw_read(fp, (uint64_t)sb.genmapStart * BLOCKSIZE, gen_table, (size_t)sb.genmapBlocks * BLOCKSIZE);
+    }
 }
 
 void store_super(FILE *fp)
 {
+    if (sb.featureFlags & FEATURE_CSUM) {
+        sb.superCsum = 0;
+        sb.superCsum = crc32c(&sb, sizeof sb);
+    }
     write_at(fp, 0, &sb, sizeof sb);
 }
 
@@ -106,42 +596,89 @@ void read_inode(FILE *fp, uint32_t idx, Inode *ino)
 {
     uint64_t off = INODE_TABLE_OFFSET + idx * INODE_SIZE;
     read_at(fp, off, ino, sizeof *ino);
+    stats.inodeReads++;
+    trace_io(TRACE_READ_INODE, idx);
 }
 
 void write_inode(FILE *fp, uint32_t idx, Inode *ino)
 {
     uint64_t off = INODE_TABLE_OFFSET + idx * INODE_SIZE;
     write_at(fp, off, ino, sizeof *ino);
+    stats.inodeWrites++;
+    trace_io(TRACE_WRITE_INODE, idx);
 }
 
 void read_block(FILE *fp, uint32_t blk_no, void *buf)
 {
     read_at(fp, blk_no * BLOCKSIZE, buf, BLOCKSIZE);
+    stats.blockReads++;
+    trace_io(TRACE_READ_BLOCK, blk_no);
+}
+
+// n consecutive blocks with a single read
+void read_blocks(FILE *fp, uint32_t first, uint32_t n, void *buf)
+{
+    read_at(fp, (uint64_t)first * BLOCKSIZE, buf, (size_t)n * BLOCKSIZE);
+    stats.blockReads += n;
+    for (uint32_t i = 0; i < n; i++)
+        trace_io(TRACE_READ_BLOCK, first + i);
 }
 
 void write_block(FILE *fp, uint32_t blk_no, const void *buf)
 {
-    write_at(fp, blk_no * BLOCKSIZE, buf, BLOCKSIZE);
+    stats.blockWrites++;
+    trace_io(TRACE_WRITE_BLOCK, blk_no);
+    if (!run_buf) {
+        write_at(fp, blk_no * BLOCKSIZE, buf, BLOCKSIZE);
+        return;
+    }
+
+    if (run_len && blk_no >= run_start && blk_no < run_start + run_len) {
+        memcpy(run_buf + (blk_no - run_start) * BLOCKSIZE, buf, BLOCKSIZE);
+        return;
+    }
+    if (!run_len || blk_no != run_start + run_len || run_len == RUN_MAX_BLOCKS) {
+        run_flush(fp);
+        run_start = blk_no;
+    }
+    memcpy(run_buf + run_len * BLOCKSIZE, buf, BLOCKSIZE);
+    run_len++;
 }
 
-// find first free bit in bitmap and allocate
-uint32_t alloc_from_bitmap(FILE *fp, uint64_t bmp_off)
+// placement state of the current command: data blocks are searched from
+// alloc_goal on (callers point it at the parent directory's block), and
+// blocks reserved by prealloc() are handed out before anything else
+uint32_t alloc_goal = 0;
+uint32_t prealloc_next = 0, prealloc_end = 0; // window [next, end), already marked used
+
+// find a free bit in bitmap and allocate: the first one at or after goal,
+// wrapping around; the whole bitmap is read at once
+uint32_t alloc_from_bitmap(FILE *fp, uint64_t bmp_off, uint32_t count, uint32_t goal)
 {
-    uint8_t byte;
-    for (uint32_t i = 0; i < sb.totalBlockCount; i++)
+    uint8_t bmp[BLOCKSIZE];
+    if (count > BLOCKSIZE * 8)
+        count = BLOCKSIZE * 8; // one bitmap block is all there is
+    read_at(fp, bmp_off, bmp, (count + 7) / 8);
+
+    if (goal >= count)
+        goal = 0;
+    for (uint32_t n = 0; n < count; n++)
     {
-        uint64_t off = bmp_off + i / 8;
-        read_at(fp, off, &byte, 1);
-        if (!(byte & (1 << (i & 7)))) //free bit
+        uint32_t i = goal + n < count ? goal + n : goal + n - count;
+        if (!(bmp[i / 8] & (1 << (i & 7)))) //free bit
         {
-            byte |= 1 << (i & 7);
-            write_at(fp, off, &byte, 1);
+            bmp[i / 8] |= 1 << (i & 7);
+            write_at(fp, bmp_off + i / 8, &bmp[i / 8], 1);
             return i;
         }
     }
     return UINT32_MAX;
 }
 
+// FEATURE_DISCARD: blocks freed by the command, punched by close_image()
+uint8_t discard_pending[BLOCKSIZE];
+uint32_t discard_cnt = 0;
+
 void free_in_bitmap(FILE *fp, uint64_t bmp_off, uint32_t idx)
 {
     uint8_t byte;
@@ -149,11 +686,117 @@ void free_in_bitmap(FILE *fp, uint64_t bmp_off, uint32_t idx)
     read_at(fp, off, &byte, 1);
     byte &= ~(1 << (idx & 7)); // clear the bit
     write_at(fp, off, &byte, 1);
+
+    if (bmp_off == BLOCK_BITMAP_OFFSET && (sb.featureFlags & FEATURE_DISCARD)) {
+        discard_pending[idx / 8] |= 1 << (idx & 7);
+        discard_cnt++;
+    }
+}
+
+// gives the blocks freed by this command back to the host, one
+// fallocate(PUNCH_HOLE) per run; blocks that got reused since are skipped
+void discard_flush(FILE *fp)
+{
+    if (!discard_cnt)
+        return;
+    discard_cnt = 0;
+    fflush(fp); // nothing buffered may land in a hole afterwards
+
+    uint8_t bmp[BLOCKSIZE];
+    uint32_t count = sb.totalBlockCount < BLOCKSIZE * 8 ? sb.totalBlockCount : BLOCKSIZE * 8;
+    read_at(fp, BLOCK_BITMAP_OFFSET, bmp, (count + 7) / 8);
+
+    uint32_t run = 0;
+    for (uint32_t i = 0; i <= count; i++) {
+        bool punch = i < count && (discard_pending[i / 8] & (1 << (i & 7))) &&
+                     !(bmp[i / 8] & (1 << (i & 7)));
+        if (punch) {
+            run++;
+            continue;
+        }
+        if (run && fallocate(fileno(fp), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                             (off_t)(i - run) * BLOCKSIZE, (off_t)run * BLOCKSIZE) == 0)
+            stats.discards += run;
+        run = 0;
+    }
+    memset(discard_pending, 0, sizeof discard_pending);
+}
+
+// the end of every command that opened the image
+void close_image(FILE *fp)
+{
+    discard_flush(fp);
+    fclose(fp);
+}
+
+// finds n free blocks in a row, preferring runs at or after goal, marks them
+// used and returns the first (UINT32_MAX if there is no such run);
+// the caller accounts freeBlockCount
+uint32_t alloc_run(FILE *fp, uint32_t n, uint32_t goal)
+{
+    uint8_t bmp[BLOCKSIZE];
+    uint32_t count = sb.totalBlockCount < BLOCKSIZE * 8 ? sb.totalBlockCount : BLOCKSIZE * 8;
+    read_at(fp, BLOCK_BITMAP_OFFSET, bmp, (count + 7) / 8);
+
+    for (uint32_t from = goal < count ? goal : 0;; from = 0)
+    {
+        uint32_t run = 0;
+        for (uint32_t i = from; i < count; i++)
+        {
+            run = (bmp[i / 8] & (1 << (i & 7))) ? 0 : run + 1;
+            if (run == n)
+            {
+                uint32_t first = i + 1 - n;
+                for (uint32_t j = first; j <= i; j++)
+                    bmp[j / 8] |= 1 << (j & 7);
+                write_at(fp, BLOCK_BITMAP_OFFSET + first / 8, bmp + first / 8, i / 8 - first / 8 + 1);
+                return first;
+            }
+        }
+        if (from == 0)
+            return UINT32_MAX;
+    }
+}
+
+// reserves a contiguous window for the n blocks a file is about to get, so
+// they end up physically sequential; without such a run the blocks are
+// placed one by one as before
+void prealloc(FILE *fp, uint32_t n)
+{
+    if (n < 2)
+        return;
+    uint32_t first = alloc_run(fp, n, alloc_goal);
+    if (first == UINT32_MAX)
+        return;
+    prealloc_next = first;
+    prealloc_end = first + n;
+}
+
+// gives back the part of the window that was not used (dedup hits, holes)
+void prealloc_release(FILE *fp)
+{
+    for (; prealloc_next < prealloc_end; prealloc_next++)
+        free_in_bitmap(fp, BLOCK_BITMAP_OFFSET, prealloc_next);
+    prealloc_next = prealloc_end = 0;
 }
 
 // allocation of a block and an inode look same from bitmap perspetive - just at different offset
-uint32_t alloc_block(FILE *fp) { return alloc_from_bitmap(fp, BLOCK_BITMAP_OFFSET); }
-uint32_t alloc_inode(FILE *fp) { return alloc_from_bitmap(fp, INODE_BITMAP_OFFSET); }
+uint32_t alloc_block(FILE *fp)
+{
+    if (prealloc_next < prealloc_end)
+        return prealloc_next++;
+
+    uint32_t b = alloc_from_bitmap(fp, BLOCK_BITMAP_OFFSET, sb.totalBlockCount, alloc_goal);
+    if (b != UINT32_MAX)
+        alloc_goal = b + 1; // keep the next block of the same file right behind
+    return b;
+}
+
+// inodes go right after their parent's, i.e. usually in the same inode table block
+uint32_t alloc_inode(FILE *fp, uint32_t parent_idx)
+{
+    return alloc_from_bitmap(fp, INODE_BITMAP_OFFSET, sb.totalInodeCount, parent_idx + 1);
+}
 
 
 // find the entry by name inside block of DirectoryEntrys
@@ -266,90 +909,654 @@ uint32_t path_lookup(FILE *fp, const char *path, uint32_t *parent_out, char *lea
     return UINT32_MAX; //should not reach here
 }
 
-void cmd_mkdir(const char *img, const char *path)
+// appends "/name" to the path in out ("/" stays a single slash); a walker
+// sizes out for its parent's path plus MAX_FILENAME, so running out of room
+// means a corrupt name and fails instead of truncating
+void path_append(char *out, size_t cap, const char *name)
 {
-    FILE *fp = open_image_rw(img);
-    load_super(fp);
-
-    uint32_t parent_idx;
-    char name[MAX_FILENAME];
-    if (path_lookup(fp, path, &parent_idx, name) == UINT32_MAX)
-        die("mkdir: component not found");
-    
-    Inode parent;
-    read_inode(fp, parent_idx, &parent);
-    if (!parent.isDirectory)
-        die("mkdir: parent not dir");
+    size_t len = strcmp(out, "/") == 0 ? 0 : strlen(out);
+    int n = snprintf(out + len, cap - len, "/%.*s", MAX_FILENAME, name);
+    if (n < 0 || (size_t)n >= cap - len) {
+        errno = ENAMETOOLONG;
+        die("path");
+    }
+}
 
-    DirectoryEntry blk[BLOCKSIZE / sizeof(DirectoryEntry)];
-    read_block(fp, parent.directPointers[0], blk);
-    if (find_entry_in_block(blk, name, NULL) == 0)
-        die("mkdir: already exists");
+// ---------------------------------------------------------------------------
+// compression
+// a small LZ77 codec in the LZ4 style: each sequence is a token byte
+// (literal count << 4 | match length - LZ_MIN_MATCH), extra length bytes for
+// nibbles of 15, the literals, then a 16-bit match offset and extra match
+// length bytes. the last sequence has literals only; the decoder knows the
+// expected output length and stops there
+// ---------------------------------------------------------------------------
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
 
+// returns compressed size, or 0 if the output would not fit in cap
+uint32_t lz_compress(const uint8_t *src, uint32_t n, uint8_t *dst, uint32_t cap)
+{
+    int32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0xff, sizeof table);
 
-    // check if the parent directory has space for a new entry
-    uint32_t new_ino_idx = alloc_inode(fp);
-    if (new_ino_idx == UINT32_MAX)
-        die("no free inodes");
-    uint32_t new_blk_idx = alloc_block(fp);
-    if (new_blk_idx == UINT32_MAX)
-        die("no free blocks");
+    uint32_t ip = 0, anchor = 0, op = 0;
 
-    sb.freeInodeCount--;
-    sb.freeBlockCount--;
-    store_super(fp);
+    #define LZ_PUT(b) do { if (op >= cap) return 0; dst[op++] = (uint8_t)(b); } while (0)
+    #define LZ_PUT_LEN(l) do { uint32_t r_ = (l); \
+        while (r_ >= 255) { LZ_PUT(255); r_ -= 255; } LZ_PUT(r_); } while (0)
 
-    Inode nd = {0};
-    nd.isDirectory = 1;
-    nd.linkCount = 1;
-    nd.directPointers[0] = new_blk_idx;
-    write_inode(fp, new_ino_idx, &nd);
+    while (ip + LZ_MIN_MATCH <= n) {
+        uint32_t seq = lz_read32(src + ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int32_t ref = table[h];
+        table[h] = ip;
 
+        if (ref < 0 || ip - ref > UINT16_MAX || lz_read32(src + ref) != seq) {
+            ip++;
+            continue;
+        }
 
-    uint8_t zero_block[BLOCKSIZE] = {0};
-    DirectoryEntry *ents = (DirectoryEntry *)zero_block;
-    strncpy(ents[0].name, ".", MAX_FILENAME);
-    ents[0].inodeIndex = new_ino_idx;
+        uint32_t mlen = LZ_MIN_MATCH;
+        while (ip + mlen < n && src[ref + mlen] == src[ip + mlen])
+            mlen++;
+
+        uint32_t lits = ip - anchor;
+        uint32_t ml = mlen - LZ_MIN_MATCH;
+        LZ_PUT((lits < 15 ? lits : 15) << 4 | (ml < 15 ? ml : 15));
+        if (lits >= 15) LZ_PUT_LEN(lits - 15);
+        if (op + lits > cap) return 0;
+        memcpy(dst + op, src + anchor, lits);
+        op += lits;
+        LZ_PUT((ip - ref) & 0xff);
+        LZ_PUT((ip - ref) >> 8);
+        if (ml >= 15) LZ_PUT_LEN(ml - 15);
+
+        ip += mlen;
+        anchor = ip;
+    }
 
-    strncpy(ents[1].name, "..", MAX_FILENAME);
-    ents[1].inodeIndex = parent_idx;
+    uint32_t lits = n - anchor;
+    LZ_PUT((lits < 15 ? lits : 15) << 4);
+    if (lits >= 15) LZ_PUT_LEN(lits - 15);
+    if (op + lits > cap) return 0;
+    memcpy(dst + op, src + anchor, lits);
+    op += lits;
 
-    write_block(fp, new_blk_idx, zero_block);
+    #undef LZ_PUT
+    #undef LZ_PUT_LEN
+    return op;
+}
 
-    if (add_entry_to_dir(fp, &parent, parent_idx, name, new_ino_idx) < 0)
-        die("mkdir: parent directory full");
+// returns 0 on success, -1 if the stream is corrupt
+int lz_decompress(const uint8_t *src, uint32_t srclen, uint8_t *dst, uint32_t n)
+{
+    uint32_t ip = 0, op = 0;
+
+    while (op < n) {
+        if (ip >= srclen) return -1;
+        uint8_t token = src[ip++];
+
+        uint32_t lits = token >> 4;
+        if (lits == 15) {
+            uint8_t b;
+            do {
+                if (ip >= srclen) return -1;
+                b = src[ip++];
+                lits += b;
+            } while (b == 255);
+        }
+        if (ip + lits > srclen || op + lits > n) return -1;
+        memcpy(dst + op, src + ip, lits);
+        ip += lits;
+        op += lits;
+        if (op == n)
+            break;
 
-    fclose(fp);
-    printf("mkdir: created %s\n", path);
+        if (ip + 2 > srclen) return -1;
+        uint32_t off = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        uint32_t mlen = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            uint8_t b;
+            do {
+                if (ip >= srclen) return -1;
+                b = src[ip++];
+                mlen += b;
+            } while (b == 255);
+        }
+        if (off == 0 || off > op || op + mlen > n) return -1;
+        for (uint32_t i = 0; i < mlen; i++, op++) // may overlap, copy bytewise
+            dst[op] = dst[op - off];
+    }
+    return 0;
 }
 
-void cmd_ls(const char *img, const char *path)
+// ---------------------------------------------------------------------------
+// shared blocks
+// the refcount table holds one uint16 per block: the number of references
+// beyond the first, so a freshly zeroed table means "nothing is shared".
+// the dedup index is an open-addressed hash table of {content hash, block};
+// blk 0 marks an empty slot (block 0 is the superblock), DEDUP_TOMBSTONE a
+// deleted one. both live in contiguous block runs found via the superblock
+// ---------------------------------------------------------------------------
+#define DEDUP_TOMBSTONE UINT32_MAX
+
+#pragma pack(push, 1)
+typedef struct
 {
-    FILE *fp = open_image_rw(img);
-    load_super(fp);
+    uint32_t hash;
+    uint32_t blk;
+} DedupSlot;
+#pragma pack(pop)
 
-    // find the inode of the path
-    uint32_t parent_idx;
-    uint32_t ino_idx = path_lookup(fp, path, &parent_idx, NULL);
+uint32_t refcount_table_blocks(uint32_t total) { return (total * sizeof(uint16_t) + BLOCKSIZE - 1) / BLOCKSIZE; }
 
-    // if the path is the root, set parent_idx to 0
-    if (ino_idx == UINT32_MAX ||
-        (strcmp(path, "/") != 0 && ino_idx == parent_idx))
-        die("ls: not found");
+uint32_t dedup_index_slots(uint32_t total)
+{
+    // load factor stays <= 1/2 even with every block indexed
+    uint32_t slots = BLOCKSIZE / sizeof(DedupSlot);
+    while (slots < 2 * total)
+        slots *= 2;
+    return slots;
+}
 
-    Inode ino;
-    read_inode(fp, ino_idx, &ino);
+uint32_t dedup_index_blocks(uint32_t total) { return dedup_index_slots(total) * sizeof(DedupSlot) / BLOCKSIZE; }
 
-    // if path is file -> print its size
-    if (!ino.isDirectory) {
-        printf("%s  %u bytes\n", path, ino.size);
-        fclose(fp);
-        return;
-    }
+uint16_t refcount_get(FILE *fp, uint32_t blk)
+{
+    uint16_t extra = 0;
+    if (sb.refcountBlocks)
+        read_at(fp, (uint64_t)sb.refcountStart * BLOCKSIZE + blk * sizeof extra, &extra, sizeof extra);
+    return extra;
+}
 
-    
-    DirectoryEntry dir[DIRS_PER_BLOCK];
-    read_block(fp, ino.directPointers[0], dir);
+void refcount_set(FILE *fp, uint32_t blk, uint16_t extra)
+{
+    write_at(fp, (uint64_t)sb.refcountStart * BLOCKSIZE + blk * sizeof extra, &extra, sizeof extra);
+}
+
+// takes another reference on a block; fails when it is already shared UINT16_MAX times
+bool refcount_inc(FILE *fp, uint32_t blk)
+{
+    uint16_t extra = refcount_get(fp, blk);
+    if (extra == UINT16_MAX)
+        return false;
+    refcount_set(fp, blk, extra + 1);
+    return true;
+}
+
+uint32_t block_hash(const uint8_t *buf)
+{
+    uint32_t h = 2166136261u; // FNV-1a
+    for (uint32_t i = 0; i < BLOCKSIZE; i++)
+        h = (h ^ buf[i]) * 16777619u;
+    return h;
+}
+
+uint64_t dedup_slot_off(uint32_t slot) { return (uint64_t)sb.dedupIndexStart * BLOCKSIZE + slot * sizeof(DedupSlot); }
+
+// returns a block holding exactly buf, or UINT32_MAX
+uint32_t dedup_lookup(FILE *fp, const uint8_t *buf, uint32_t hash)
+{
+    uint32_t mask = dedup_index_slots(sb.totalBlockCount) - 1;
+    uint8_t cand[BLOCKSIZE];
+    DedupSlot s;
+
+    // at most one pass: with no empty slot left the probe would never end
+    for (uint32_t n = 0, i = hash & mask; n <= mask; n++, i = (i + 1) & mask) {
+        read_at(fp, dedup_slot_off(i), &s, sizeof s);
+        if (s.blk == 0)
+            return UINT32_MAX;
+        if (s.blk == DEDUP_TOMBSTONE || s.hash != hash)
+            continue;
+        read_block(fp, s.blk, cand); // hashes collide, contents must not
+        if (memcmp(cand, buf, BLOCKSIZE) == 0)
+            return s.blk;
+    }
+    return UINT32_MAX;
+}
+
+void dedup_insert(FILE *fp, uint32_t blk, uint32_t hash)
+{
+    uint32_t mask = dedup_index_slots(sb.totalBlockCount) - 1;
+    DedupSlot s;
+
+    for (uint32_t n = 0, i = hash & mask; n <= mask; n++, i = (i + 1) & mask) {
+        read_at(fp, dedup_slot_off(i), &s, sizeof s);
+        if (s.blk == 0 || s.blk == DEDUP_TOMBSTONE) {
+            s.hash = hash;
+            s.blk = blk;
+            write_at(fp, dedup_slot_off(i), &s, sizeof s);
+            return;
+        }
+    }
+    errno = ENOSPC; // cannot happen while slots >= 2 * blocks, but never spin
+    die("dedup index full");
+}
+
+// drops the index entry of a block that is about to be freed, so the index
+// only ever points at live file data. a tombstone is only needed while a
+// probe chain runs past it: when the next slot is empty the entry and the
+// tombstones right before it become empty slots again, so the index cannot
+// fill up with tombstones
+void dedup_forget(FILE *fp, uint32_t blk)
+{
+    uint32_t mask = dedup_index_slots(sb.totalBlockCount) - 1;
+    uint8_t buf[BLOCKSIZE];
+    read_block(fp, blk, buf);
+    uint32_t hash = block_hash(buf);
+    DedupSlot s, next;
+
+    for (uint32_t n = 0, i = hash & mask; n <= mask; n++, i = (i + 1) & mask) {
+        read_at(fp, dedup_slot_off(i), &s, sizeof s);
+        if (s.blk == 0)
+            return;
+        if (s.blk != blk)
+            continue;
+
+        read_at(fp, dedup_slot_off((i + 1) & mask), &next, sizeof next);
+        if (next.blk != 0) {
+            s.blk = DEDUP_TOMBSTONE;
+            write_at(fp, dedup_slot_off(i), &s, sizeof s);
+            return;
+        }
+        memset(&s, 0, sizeof s);
+        for (uint32_t m = 0; m <= mask; m++, i = (i - 1) & mask) {
+            write_at(fp, dedup_slot_off(i), &s, sizeof s);
+            read_at(fp, dedup_slot_off((i - 1) & mask), &next, sizeof next);
+            if (next.blk != DEDUP_TOMBSTONE)
+                break;
+        }
+        return;
+    }
+}
+
+// drops one reference; the block is only freed with its last one
+void release_block(FILE *fp, uint32_t blk)
+{
+    uint16_t extra = refcount_get(fp, blk);
+    if (extra) {
+        refcount_set(fp, blk, extra - 1);
+        return;
+    }
+    if (sb.featureFlags & FEATURE_DEDUP)
+        dedup_forget(fp, blk);
+    free_in_bitmap(fp, BLOCK_BITMAP_OFFSET, blk);
+    sb.freeBlockCount++;
+}
+
+// frees every data block of the inode (unused pointer slots are always 0)
+void release_data(FILE *fp, Inode *ino)
+{
+    if (ino->flags & INODE_INLINE)
+        return;
+    for (uint32_t i = 0; i < DIRECTBLOCK_CNT; i++)
+        if (ino->directPointers[i])
+            release_block(fp, ino->directPointers[i]);
+}
+
+void release_inode_and_data(FILE *fp, uint32_t ino_idx, Inode *ino)
+{
+    release_data(fp, ino);
+
+    free_in_bitmap(fp, INODE_BITMAP_OFFSET, ino_idx);
+    sb.freeInodeCount++;
+}
+
+// writes one block of file data and returns where it lives: with dedup on,
+// an existing identical block is shared instead of allocating a new one
+uint32_t store_block(FILE *fp, const uint8_t *buf)
+{
+    uint32_t hash = 0;
+    if (sb.featureFlags & FEATURE_DEDUP) {
+        hash = block_hash(buf);
+        uint32_t b = dedup_lookup(fp, buf, hash);
+        if (b != UINT32_MAX && refcount_inc(fp, b)) {
+            stats.dedupHits++;
+            return b;
+        }
+    }
+
+    if (!sb.freeBlockCount)
+        die("not enough free blocks");
+    uint32_t b = alloc_block(fp);
+    if (b == UINT32_MAX)
+        die("alloc_block");
+    sb.freeBlockCount--;
+    write_block(fp, b, buf);
+
+    if (sb.featureFlags & FEATURE_DEDUP)
+        dedup_insert(fp, b, hash);
+    return b;
+}
+
+// reserves and zeroes a run of blocks for a per-block table on an existing image
+uint32_t create_table(FILE *fp, uint32_t blocks)
+{
+    uint32_t start = alloc_run(fp, blocks, 0);
+    if (start == UINT32_MAX)
+        die("no contiguous free space for table");
+    sb.freeBlockCount -= blocks;
+
+    uint8_t z[BLOCKSIZE] = {0};
+    for (uint32_t i = 0; i < blocks; i++)
+        write_block(fp, start + i, z);
+    return start;
+}
+
+bool is_zero(const uint8_t *buf, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        if (buf[i])
+            return false;
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// file data
+// a compressed file is cut into clusters of CLUSTER_BLOCKS logical blocks;
+// each cluster is stored in its own run of directPointers slots, either
+// LZ-packed or raw, as described by its nibble in Inode.clusterMap.
+// a cluster can be decoded on its own: its first slot is the sum of the
+// physical block counts of the clusters before it
+// ---------------------------------------------------------------------------
+#define MAX_FILE_SIZE (DIRECTBLOCK_CNT * BLOCKSIZE)
+
+uint32_t cluster_blocks(const Inode *ino, uint32_t c) { return (ino->clusterMap >> (4 * c)) & CLUSTER_COUNT_MASK; }
+bool cluster_packed(const Inode *ino, uint32_t c) { return (ino->clusterMap >> (4 * c)) & CLUSTER_PACKED; }
+
+// logical bytes covered by cluster c of a file of the given size
+uint32_t cluster_len(uint32_t size, uint32_t c)
+{
+    uint32_t start = c * CLUSTER_BLOCKS * BLOCKSIZE;
+    if (size <= start)
+        return 0;
+    uint32_t len = size - start;
+    return len < CLUSTER_BLOCKS * BLOCKSIZE ? len : CLUSTER_BLOCKS * BLOCKSIZE;
+}
+
+// decodes cluster c into out (CLUSTER_BLOCKS * BLOCKSIZE bytes)
+void read_cluster(FILE *fp, const Inode *ino, uint32_t c, uint8_t *out)
+{
+    uint32_t first = 0;
+    for (uint32_t i = 0; i < c; i++)
+        first += cluster_blocks(ino, i);
+
+    uint32_t cnt = cluster_blocks(ino, c);
+    if (!cnt) { // all-zero cluster, stored as a hole
+        memset(out, 0, CLUSTER_BYTES);
+        return;
+    }
+    uint8_t raw[CLUSTER_BLOCKS * BLOCKSIZE];
+    uint8_t *dst = cluster_packed(ino, c) ? raw : out;
+    for (uint32_t i = 0; i < cnt; i++)
+        read_block(fp, ino->directPointers[first + i], dst + i * BLOCKSIZE);
+
+    if (cluster_packed(ino, c) &&
+        lz_decompress(raw, cnt * BLOCKSIZE, out, cluster_len(ino->size, c)) < 0)
+    {
+        errno = EIO;
+        die("read_cluster: corrupt compressed cluster");
+    }
+}
+
+// reads the whole content of a file into out (MAX_FILE_SIZE bytes)
+void load_file_data(FILE *fp, const Inode *ino, uint8_t *out)
+{
+    memset(out, 0, MAX_FILE_SIZE);
+    if (ino->flags & INODE_INLINE) {
+        memcpy(out, ino->directPointers, ino->size);
+        return;
+    }
+    if (ino->flags & INODE_COMPRESSED) {
+        for (uint32_t c = 0; c < CLUSTER_CNT && cluster_len(ino->size, c); c++)
+            read_cluster(fp, ino, c, out + c * CLUSTER_BLOCKS * BLOCKSIZE);
+        return;
+    }
+    // physically consecutive blocks are read together
+    uint32_t blocks = (ino->size + BLOCKSIZE - 1) / BLOCKSIZE;
+    for (uint32_t i = 0, n; i < blocks; i += n) {
+        uint32_t b = ino->directPointers[i];
+        for (n = 1; i + n < blocks && b != HOLE && ino->directPointers[i + n] == b + n; n++)
+            ;
+        if (b != HOLE)
+            read_blocks(fp, b, n, out + i * BLOCKSIZE);
+    }
+}
+
+// (re)encodes the clusters from first_c on of a compressed file from data;
+// the clusters before first_c keep their blocks, and with them any sharing
+void store_clusters(FILE *fp, Inode *ino, const uint8_t *data, uint32_t first_c)
+{
+    uint32_t slot = 0;
+    for (uint32_t c = 0; c < first_c; c++)
+        slot += cluster_blocks(ino, c);
+
+    for (uint32_t i = slot; i < DIRECTBLOCK_CNT; i++)
+        if (ino->directPointers[i]) {
+            release_block(fp, ino->directPointers[i]);
+            ino->directPointers[i] = 0;
+        }
+    ino->clusterMap &= (1u << (4 * first_c)) - 1;
+
+    // lay out the physical blocks first so we know the count before allocating
+    static uint8_t phys[MAX_FILE_SIZE];
+    uint32_t need = 0;
+
+    for (uint32_t c = first_c; c < CLUSTER_CNT && cluster_len(ino->size, c); c++) {
+        uint32_t len = cluster_len(ino->size, c);
+        uint32_t lblocks = (len + BLOCKSIZE - 1) / BLOCKSIZE;
+        uint8_t *dst = phys + need * BLOCKSIZE;
+        const uint8_t *src = data + c * CLUSTER_BYTES;
+
+        if (is_zero(src, len))
+            continue; // hole: count 0, nothing stored
+
+        // only worth it if it saves at least one block
+        memset(dst, 0, lblocks * BLOCKSIZE);
+        uint32_t clen = lz_compress(src, len, dst, (lblocks - 1) * BLOCKSIZE);
+        uint32_t pblocks;
+        if (clen) {
+            pblocks = (clen + BLOCKSIZE - 1) / BLOCKSIZE;
+            ino->clusterMap |= (pblocks | CLUSTER_PACKED) << (4 * c);
+        } else {
+            memset(dst, 0, lblocks * BLOCKSIZE);
+            memcpy(dst, src, len);
+            pblocks = lblocks;
+            ino->clusterMap |= pblocks << (4 * c);
+        }
+        need += pblocks;
+    }
+
+    // with dedup the count is only an upper bound, store_block checks as it goes
+    if (need > sb.freeBlockCount && !(sb.featureFlags & FEATURE_DEDUP))
+        die("not enough free blocks");
+
+    if (slot)
+        alloc_goal = ino->directPointers[slot - 1] + 1; // continue behind the kept clusters
+    prealloc(fp, need);
+    for (uint32_t i = 0; i < need; i++)
+        ino->directPointers[slot + i] = store_block(fp, phys + i * BLOCKSIZE);
+    prealloc_release(fp);
+}
+
+// stores data as the content of an inode that owns no blocks yet: inline if
+// it fits, LZ-packed clusters if compress is set, plain blocks otherwise
+void store_file_data(FILE *fp, Inode *ino, const uint8_t *data, uint32_t size, bool compress)
+{
+    memset(ino->directPointers, 0, sizeof ino->directPointers);
+    ino->flags &= ~(INODE_INLINE | INODE_COMPRESSED);
+    ino->clusterMap = 0;
+    ino->size = size;
+
+    if (size <= INLINE_MAX) {
+        memcpy(ino->directPointers, data, size);
+        ino->flags |= INODE_INLINE;
+        return;
+    }
+
+    if (compress) {
+        ino->flags |= INODE_COMPRESSED;
+        store_clusters(fp, ino, data, 0);
+        return;
+    }
+
+    // all-zero blocks are left as holes
+    uint32_t blocks = (size + BLOCKSIZE - 1) / BLOCKSIZE;
+    uint32_t need = 0;
+    for (uint32_t i = 0; i < blocks; i++)
+        if (!is_zero(data + i * BLOCKSIZE, (i == blocks - 1) ? size - i * BLOCKSIZE : BLOCKSIZE))
+            need++;
+    if (need > sb.freeBlockCount && !(sb.featureFlags & FEATURE_DEDUP))
+        die("not enough free blocks");
+
+    // the size is known up front, so ask for one contiguous run
+    prealloc(fp, need);
+    uint8_t buf[BLOCKSIZE];
+    for (uint32_t i = 0; i < blocks; i++) {
+        uint32_t chunk = (i == blocks - 1) ? size - i * BLOCKSIZE : BLOCKSIZE;
+        if (is_zero(data + i * BLOCKSIZE, chunk))
+            continue;
+        memset(buf, 0, BLOCKSIZE);
+        memcpy(buf, data + i * BLOCKSIZE, chunk);
+        ino->directPointers[i] = store_block(fp, buf);
+    }
+    prealloc_release(fp);
+}
+
+// replaces the content of data slot k, breaking sharing: shared or indexed
+// blocks are never written in place, the new content gets a block of its own
+void rewrite_block(FILE *fp, Inode *ino, uint32_t k, const uint8_t *buf)
+{
+    uint32_t old = ino->directPointers[k];
+    if (!refcount_get(fp, old) && !(sb.featureFlags & FEATURE_DEDUP)) {
+        write_block(fp, old, buf);
+        return;
+    }
+    alloc_goal = old; // the copy goes as close to the original as possible
+    ino->directPointers[k] = store_block(fp, buf);
+    release_block(fp, old);
+}
+
+// creates an empty directory called name in parent and returns its inode
+uint32_t make_dir(FILE *fp, Inode *parent, uint32_t parent_idx, const char *name)
+{
+    uint32_t new_ino_idx = alloc_inode(fp, parent_idx);
+    if (new_ino_idx == UINT32_MAX)
+        die("no free inodes");
+    alloc_goal = parent->directPointers[0]; // next to the parent's entries
+    uint32_t new_blk_idx = alloc_block(fp);
+    if (new_blk_idx == UINT32_MAX)
+        die("no free blocks");
+
+    sb.freeInodeCount--;
+    sb.freeBlockCount--;
+
+    Inode nd = {0};
+    nd.isDirectory = 1;
+    nd.linkCount = 1;
+    nd.directPointers[0] = new_blk_idx;
+    write_inode(fp, new_ino_idx, &nd);
+
+
+    uint8_t zero_block[BLOCKSIZE] = {0};
+    DirectoryEntry *ents = (DirectoryEntry *)zero_block;
+    strncpy(ents[0].name, ".", MAX_FILENAME);
+    ents[0].inodeIndex = new_ino_idx;
+
+    strncpy(ents[1].name, "..", MAX_FILENAME);
+    ents[1].inodeIndex = parent_idx;
+
+    write_block(fp, new_blk_idx, zero_block);
+
+    if (add_entry_to_dir(fp, parent, parent_idx, name, new_ino_idx) < 0)
+        die("mkdir: parent directory full");
+    return new_ino_idx;
+}
+
+// creates a file called name in parent holding data and returns its inode
+uint32_t make_file(FILE *fp, Inode *parent, uint32_t parent_idx, const char *name,
+                   const uint8_t *data, uint32_t size, bool compress)
+{
+    uint32_t ino_idx = alloc_inode(fp, parent_idx);
+    if (ino_idx == UINT32_MAX) die("no free inodes");
+    sb.freeInodeCount--; // counted right away, like the bitmap, in case we die below
+    alloc_goal = parent->directPointers[0]; // data goes near the directory
+
+    // tiny files go straight into the inode: no bitmap scan, no data block
+    Inode ino = {0};
+    ino.linkCount  = 1;
+    ino.isDirectory = 0;
+    store_file_data(fp, &ino, data, size,
+                    compress || (sb.featureFlags & FEATURE_COMPRESS));
+    write_inode(fp, ino_idx, &ino);
+
+    if (add_entry_to_dir(fp, parent, parent_idx, name, ino_idx) < 0)
+        die("parent directory full");
+    return ino_idx;
+}
+
+void cmd_mkdir(const char *img, const char *path)
+{
+    FILE *fp = open_image_rw(img);
+    load_super(fp);
+
+    uint32_t parent_idx;
+    char name[MAX_FILENAME];
+    if (path_lookup(fp, path, &parent_idx, name) == UINT32_MAX)
+        die("mkdir: component not found");
+    
+    Inode parent;
+    read_inode(fp, parent_idx, &parent);
+    if (!parent.isDirectory)
+        die("mkdir: parent not dir");
+
+    DirectoryEntry blk[BLOCKSIZE / sizeof(DirectoryEntry)];
+    read_block(fp, parent.directPointers[0], blk);
+    if (find_entry_in_block(blk, name, NULL) == 0)
+        die("mkdir: already exists");
+
+    make_dir(fp, &parent, parent_idx, name);
+
+    store_super(fp);
+    close_image(fp);
+    printf("mkdir: created %s\n", path);
+}
+
+void cmd_ls(const char *img, const char *path)
+{
+    FILE *fp = open_image_rw(img);
+    load_super(fp);
+
+    // find the inode of the path
+    uint32_t parent_idx;
+    uint32_t ino_idx = path_lookup(fp, path, &parent_idx, NULL);
+
+    // if the path is the root, set parent_idx to 0
+    if (ino_idx == UINT32_MAX ||
+        (strcmp(path, "/") != 0 && ino_idx == parent_idx))
+        die("ls: not found");
+
+    Inode ino;
+    read_inode(fp, ino_idx, &ino);
+
+    // if path is file -> print its size
+    if (!ino.isDirectory) {
+        printf("%s  %u bytes\n", path, ino.size);
+        close_image(fp);
+        return;
+    }
+
+    
+    DirectoryEntry dir[DIRS_PER_BLOCK];
+    read_block(fp, ino.directPointers[0], dir);
 
     for (uint32_t i = 0; i < DIRS_PER_BLOCK; i++) {
         if (!dir[i].inodeIndex) continue;
@@ -363,7 +1570,7 @@ void cmd_ls(const char *img, const char *path)
                child.isDirectory ? "<DIR>" : "");
     }
 
-    fclose(fp);
+    close_image(fp);
 }
 
 void cmd_df(const char *img)
@@ -377,8 +1584,10 @@ void cmd_df(const char *img)
     printf("Total Inodes: %u\n", sb.totalInodeCount);
     printf("Free Inodes:  %u\n", sb.freeInodeCount);
     printf("Used Inodes:  %u\n", sb.totalInodeCount - sb.freeInodeCount);
+    if (sb.featureFlags & FEATURE_CHANGEMAP)
+        printf("Generation:   %u\n", sb.generation);
 
-    fclose(fp);
+    close_image(fp);
 }
 
 void cmd_rmdir(const char *img, const char *path)
@@ -436,11 +1645,40 @@ void cmd_rmdir(const char *img, const char *path)
     sb.freeBlockCount++;
     store_super(fp);
 
-    fclose(fp);
+    close_image(fp);
     printf("rmdir: removed %s\n", path);
 }
 
-void cmd_ecpt(const char *img, const char *host_path, const char *vfs_path)
+// reads a host file into buf, skipping its holes (SEEK_DATA/SEEK_HOLE) so
+// they come back as zeros without reading them; falls back to a plain read
+int read_host_sparse(FILE *hf, uint8_t *buf, uint64_t size)
+{
+    int fd = fileno(hf);
+    memset(buf, 0, size);
+
+    uint64_t off = 0;
+    while (off < size) {
+        off_t data = lseek(fd, off, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+            return 0; // only a hole left
+        if (data < 0)
+            break;   // no hole support on this fs
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || (uint64_t)hole > size)
+            hole = size;
+        if (pread(fd, buf + data, hole - data, data) != hole - data)
+            return -1;
+        off = hole;
+    }
+    if (off >= size)
+        return 0;
+
+    if (pread(fd, buf + off, size - off, off) != (ssize_t)(size - off))
+        return -1;
+    return 0;
+}
+
+void cmd_ecpt(const char *img, const char *host_path, const char *vfs_path, bool compress)
 {
     FILE *fp = open_image_rw(img);
     load_super(fp);
@@ -463,48 +1701,34 @@ void cmd_ecpt(const char *img, const char *host_path, const char *vfs_path)
     if (found != parent_idx)
         die("ecpt: destination already exists");
 
-    uint32_t ino_idx = alloc_inode(fp);
-    if (ino_idx == UINT32_MAX) die("ecpt: no free inodes");
-
-    uint32_t need_blocks = (fsize + BLOCKSIZE - 1) / BLOCKSIZE;
-    if (need_blocks > sb.freeBlockCount)
-        die("ecpt: not enough free blocks");
-    uint32_t blk[DIRECTBLOCK_CNT] = {0};
-    for (uint32_t i = 0; i < need_blocks; i++)
-        if ((blk[i] = alloc_block(fp)) == UINT32_MAX)
-            die("ecpt: alloc_block");
-
-    uint8_t buf[BLOCKSIZE] = {0};
-    for (uint32_t i = 0; i < need_blocks; i++) {
-
-        // read the file in chunks of upto BLOCKSIZE
-        size_t chunk = (i == need_blocks - 1) ? (fsize - i * BLOCKSIZE) : BLOCKSIZE;
-        memset(buf, 0, BLOCKSIZE); // clear the buffer
-
-        fread(buf, 1, chunk, hf);
-        write_block(fp, blk[i], buf);
-    }
+    uint8_t data[MAX_FILE_SIZE];
+    if (read_host_sparse(hf, data, fsize) < 0)
+        die("ecpt: read host file");
     fclose(hf);
 
-    Inode ino = {0};
-    ino.size       = (uint32_t)fsize;
-    ino.linkCount  = 1;
-    ino.isDirectory = 0;
-    for (uint32_t i = 0; i < need_blocks; i++) ino.directPointers[i] = blk[i];
-    write_inode(fp, ino_idx, &ino);
-
     Inode parent;
     read_inode(fp, parent_idx, &parent);
-    if (add_entry_to_dir(fp, &parent, parent_idx, leaf, ino_idx) < 0)
-        die("ecpt: parent directory full");
+    make_file(fp, &parent, parent_idx, leaf, data, (uint32_t)fsize, compress);
 
-    sb.freeInodeCount--;
-    sb.freeBlockCount -= need_blocks;
     store_super(fp);
-    fclose(fp);
+    close_image(fp);
     printf("ecpt: copied \"%s\" -> \"%s\"\n", host_path, vfs_path);
 }
 
+// skips n bytes of output: a seek (leaving a hole) on files, zeros on pipes
+void host_skip(FILE *hf, size_t n, bool seekable)
+{
+    static const uint8_t zero[CLUSTER_BYTES];
+    if (seekable) {
+        fseek(hf, n, SEEK_CUR);
+        return;
+    }
+    if (fwrite(zero, 1, n, hf) != n)
+        die("ecpf: write");
+}
+
+// copies a file out of the image; host_path "-" streams it to stdout, which
+// then carries nothing but the data
 void cmd_ecpf(const char *img, const char *vfs_path, const char *host_path)
 {
     FILE *fp = open_image_rw(img);
@@ -520,22 +1744,53 @@ void cmd_ecpf(const char *img, const char *vfs_path, const char *host_path)
     if (ino.isDirectory)
         die("ecpf: cannot copy directories (only regular files)");
 
-    FILE *hf = fopen(host_path, "wb");
+    bool to_stdout = strcmp(host_path, "-") == 0;
+    FILE *hf = to_stdout ? stdout : fopen(host_path, "wb");
     if (!hf) die("ecpf: create host file");
+    struct stat hst;
+    bool seekable = !to_stdout && fstat(fileno(hf), &hst) == 0 && S_ISREG(hst.st_mode);
 
     uint32_t blocks = (ino.size + BLOCKSIZE - 1) / BLOCKSIZE;
+    if (ino.flags & INODE_INLINE) {
+        fwrite(ino.directPointers, 1, ino.size, hf);
+        blocks = 0;
+    }
+    if (ino.flags & INODE_COMPRESSED) {
+        // one cluster at a time, no need to hold the whole file
+        uint8_t cbuf[CLUSTER_BLOCKS * BLOCKSIZE];
+        for (uint32_t c = 0; c < CLUSTER_CNT && cluster_len(ino.size, c); c++) {
+            if (!cluster_blocks(&ino, c)) {
+                host_skip(hf, cluster_len(ino.size, c), seekable); // hole on the host too
+                continue;
+            }
+            read_cluster(fp, &ino, c, cbuf);
+            fwrite(cbuf, 1, cluster_len(ino.size, c), hf);
+        }
+        blocks = 0;
+    }
     uint8_t buf[BLOCKSIZE];
     for (uint32_t i = 0; i < blocks; i++) {
-        read_block(fp, ino.directPointers[i], buf);
         size_t chunk = (i == blocks - 1) ? (ino.size - i * BLOCKSIZE) : BLOCKSIZE;
+        if (ino.directPointers[i] == HOLE) {
+            host_skip(hf, chunk, seekable); // skipped bytes become a hole on the host
+            continue;
+        }
+        read_block(fp, ino.directPointers[i], buf);
         fwrite(buf, 1, chunk, hf);
     }
+    // a trailing hole is only a seek so far, give the file its full length
+    if (fflush(hf))
+        die("ecpf: write");
+    if (seekable && ftruncate(fileno(hf), ino.size))
+        die("ecpf: truncate host file");
+    close_image(fp);
+    if (to_stdout)
+        return;
     fclose(hf);
-    fclose(fp);
     printf("ecpf: copied \"%s\" -> \"%s\"\n", vfs_path, host_path);
 }
 
-void cmd_mkfs(const char *filename, size_t disk_size)
+void cmd_mkfs(const char *filename, size_t disk_size, uint32_t features)
 {
 
     uint64_t rounded_disk_size = (disk_size / BLOCKSIZE) * BLOCKSIZE;
@@ -550,11 +1805,16 @@ void cmd_mkfs(const char *filename, size_t disk_size)
     if (!fp)
         die("open");
 
-    // prefill file with zeros
+    // prefill file with zeros; a discarding image starts out as one big hole
     uint8_t zero = 0;
-    for (size_t i = 0; i < rounded_disk_size; i++)
-    {
-        fwrite(&zero, 1, 1, fp);
+    if (features & FEATURE_DISCARD) {
+        if (ftruncate(fileno(fp), rounded_disk_size))
+            die("ftruncate");
+    } else {
+        for (size_t i = 0; i < rounded_disk_size; i++)
+        {
+            fwrite(&zero, 1, 1, fp);
+        }
     }
 
     uint32_t reserved_blocks = 4 + INODE_TABLE_BLOCKS; // +4: superblock, blockgroup descriptor, blockgroup (free/used) bitmap, inode  bitmap
@@ -562,9 +1822,35 @@ void cmd_mkfs(const char *filename, size_t disk_size)
     sb.totalBlockCount = rounded_disk_size / BLOCKSIZE;
     sb.totalInodeCount = INODE_COUNT;
     sb.freeInodeCount = INODE_COUNT - 1;                          //-1 for the root
-    sb.freeBlockCount = sb.totalBlockCount - reserved_blocks - 1; // -1 for root dir blk
     sb.blockSize = BLOCKSIZE;
     sb.dataStartOffset = DATA_BLOCKS_OFFSET;
+    sb.featureFlags = features;
+
+    // optional per-block tables go right after the root dir blk
+    uint32_t used_blocks = reserved_blocks + 1;
+    if (features & FEATURE_DEDUP) {
+        sb.refcountStart = used_blocks;
+        sb.refcountBlocks = refcount_table_blocks(sb.totalBlockCount);
+        used_blocks += sb.refcountBlocks;
+        sb.dedupIndexStart = used_blocks;
+        sb.dedupIndexBlocks = dedup_index_blocks(sb.totalBlockCount);
+        used_blocks += sb.dedupIndexBlocks;
+    }
+    if (features & FEATURE_CSUM) {
+        sb.csumStart = used_blocks;
+        sb.csumBlocks = (sb.totalBlockCount * sizeof(uint32_t) + BLOCKSIZE - 1) / BLOCKSIZE;
+        used_blocks += sb.csumBlocks;
+    }
+    if (features & FEATURE_CHANGEMAP) {
+        sb.genmapStart = used_blocks; // all zeros: everything is from generation 0
+        sb.genmapBlocks = (sb.totalBlockCount * sizeof(uint32_t) + BLOCKSIZE - 1) / BLOCKSIZE;
+        used_blocks += sb.genmapBlocks;
+        random_fill(&sb.lineage, sizeof sb.lineage);
+        gen_new();
+    }
+    if (used_blocks > sb.totalBlockCount)
+        die("Image too small");
+    sb.freeBlockCount = sb.totalBlockCount - used_blocks;
 
     printf("Total blocks: %u\n", sb.totalBlockCount);
     printf("Total inodes: %u\n", sb.totalInodeCount);
@@ -590,9 +1876,9 @@ void cmd_mkfs(const char *filename, size_t disk_size)
 
     // bitmap of used/free blocks
     uint8_t block_bitmap[BLOCKSIZE] = {0};
-    for (uint32_t i = 0; i < reserved_blocks + 1; i++)
+    for (uint32_t i = 0; i < used_blocks; i++)
     {
-        // set bits for each position of first [reserved_blocks] bit
+        // set bits for each position of first [used_blocks] bit
         block_bitmap[i / 8] |= (0x01 << (i & 7));
     }
     fseek(fp, BLOCK_BITMAP_OFFSET, SEEK_SET);
@@ -621,25 +1907,47 @@ void cmd_mkfs(const char *filename, size_t disk_size)
 
     //===================================================================
 
+    // checksums of everything written above, all the rest is zeros
+    if (features & FEATURE_CSUM) {
+        uint32_t *tab = calloc(sb.csumBlocks, BLOCKSIZE);
+        if (!tab)
+            die("calloc");
+        uint32_t zero_csum = crc32c(buf, BLOCKSIZE);
+        for (uint32_t b = 1; b < sb.totalBlockCount; b++) {
+            if (!csum_covers(b))
+                continue;
+            tab[b] = zero_csum;
+            if (b < used_blocks) {
+                raw_read(fp, (uint64_t)b * BLOCKSIZE, buf, BLOCKSIZE);
+                tab[b] = crc32c(buf, BLOCKSIZE);
+            }
+        }
+        raw_write(fp, (uint64_t)sb.csumStart * BLOCKSIZE, tab, (size_t)sb.csumBlocks * BLOCKSIZE);
+        free(tab);
+    }
+
     fflush(fp);
-    fclose(fp);
+    close_image(fp);
 }
 
-void release_block(FILE *fp, uint32_t blk)
+// data blocks an inode occupies itself: inline files none, compressed ones
+// what their clusters take, holes nothing, a directory its entry block
+uint32_t inode_blocks(const Inode *ino)
 {
-    free_in_bitmap(fp, BLOCK_BITMAP_OFFSET, blk);
-    sb.freeBlockCount++;
-}
-
-void release_inode_and_data(FILE *fp, uint32_t ino_idx, Inode *ino)
-{
-    uint32_t blks = (ino->size + BLOCKSIZE - 1) / BLOCKSIZE;
-    for (uint32_t i = 0; i < blks; i++)
-        if (ino->directPointers[i])
-            release_block(fp, ino->directPointers[i]);
-
-    free_in_bitmap(fp, INODE_BITMAP_OFFSET, ino_idx);
-    sb.freeInodeCount++;
+    if (ino->isDirectory)
+        return 1;
+    if (ino->flags & INODE_INLINE)
+        return 0;
+    uint32_t blocks = 0;
+    if (ino->flags & INODE_COMPRESSED) {
+        for (uint32_t c = 0; c < CLUSTER_CNT; c++)
+            blocks += cluster_blocks(ino, c);
+        return blocks;
+    }
+    for (uint32_t i = 0; i < DIRECTBLOCK_CNT; i++)
+        if (ino->directPointers[i] != HOLE)
+            blocks++;
+    return blocks;
 }
 
 uint64_t compute_usage(FILE *fp, uint32_t ino_idx)
@@ -649,7 +1957,7 @@ uint64_t compute_usage(FILE *fp, uint32_t ino_idx)
 
     // if the inode is not a directory, return its size, rounded-up 
     if (!ino.isDirectory)
-        return ((ino.size + BLOCKSIZE - 1) / BLOCKSIZE) * BLOCKSIZE;
+        return (uint64_t)inode_blocks(&ino) * BLOCKSIZE;
 
     // if inode is a directory -> 1 block for itself + all its children
     uint64_t total = BLOCKSIZE;
@@ -678,7 +1986,7 @@ void cmd_lsdf(const char *img, const char *path)
            path, (unsigned long long)bytes,
            bytes / 1024.0, bytes / (1024.0 * 1024.0));
 
-    fclose(fp);
+    close_image(fp);
 }
 
 
@@ -710,7 +2018,7 @@ void cmd_crhl(const char *img, const char *src, const char *dst)
     target.linkCount++;
     write_inode(fp, src_ino, &target);
 
-    fclose(fp);
+    close_image(fp);
     printf("crhl: linked %s -> %s\n", dst, src);
 }
 
@@ -758,7 +2066,7 @@ void cmd_rm(const char *img, const char *path)
         write_inode(fp, ino_idx, &ino);
 
     store_super(fp);
-    fclose(fp);
+    close_image(fp);
     printf("rm: removed %s\n", path);
 }
 
@@ -779,25 +2087,56 @@ void cmd_ext(const char *img, const char *path, uint32_t add)
 
     uint32_t old_size   = ino.size;
     uint32_t new_size   = old_size + add;
-    uint32_t old_blocks = (old_size + BLOCKSIZE - 1) / BLOCKSIZE;
     uint32_t new_blocks = (new_size + BLOCKSIZE - 1) / BLOCKSIZE;
 
     if (new_blocks > DIRECTBLOCK_CNT)
         die("ext: exceeds max direct blocks (12)");
 
-    for (uint32_t i = old_blocks; i < new_blocks; i++) {
-        uint32_t b = alloc_block(fp);
-        if (b == UINT32_MAX) die("ext: out of blocks");
-        ino.directPointers[i] = b;
-        sb.freeBlockCount--;
-        uint8_t z[BLOCKSIZE]={0};
-        write_block(fp, b, z);
+    if (ino.flags & INODE_COMPRESSED) {
+        // re-encode from the cluster holding the old end; the new bytes are zeros
+        uint8_t data[MAX_FILE_SIZE];
+        load_file_data(fp, &ino, data);
+        ino.size = new_size;
+        store_clusters(fp, &ino, data, old_size / CLUSTER_BYTES);
+        write_inode(fp, ino_idx, &ino);
+        store_super(fp);
+        close_image(fp);
+        printf("ext: %u bytes added to %s (new size %u)\n",
+               add, path, new_size);
+        return;
+    }
+
+    if (ino.flags & INODE_INLINE) {
+        // the bytes past the old size are already zero (see red)
+        if (new_size <= INLINE_MAX) {
+            ino.size = new_size;
+            write_inode(fp, ino_idx, &ino);
+            close_image(fp);
+            printf("ext: %u bytes added to %s (new size %u)\n",
+                   add, path, new_size);
+            return;
+        }
+
+        // outgrew the inode: move the data to a real block first
+        Inode parent;
+        read_inode(fp, pidx, &parent);
+        alloc_goal = parent.directPointers[0];
+
+        uint8_t first[BLOCKSIZE] = {0};
+        memcpy(first, ino.directPointers, old_size);
+        uint32_t b = is_zero(first, old_size) ? HOLE : store_block(fp, first);
+
+        memset(ino.directPointers, 0, sizeof ino.directPointers);
+        ino.directPointers[0] = b;
+        ino.flags &= ~INODE_INLINE;
     }
 
+    // the new blocks are holes; the tail of the old last block is already zero
+
     ino.size = new_size;
     write_inode(fp, ino_idx, &ino);
     store_super(fp);
-    fclose(fp);
+    close_image(fp);
     printf("ext: %u bytes added to %s (new size %u)\n",
            add, path, new_size);
 }
@@ -818,12 +2157,36 @@ void cmd_red(const char *img, const char *path, uint32_t sub)
     if (sub >= ino.size) {
         release_inode_and_data(fp, ino_idx, &ino);
         store_super(fp);
-        fclose(fp);
+        close_image(fp);
         printf("red: %s truncated to 0\n", path);
         return;
     }
 
     uint32_t new_size   = ino.size - sub;
+    if (ino.flags & INODE_COMPRESSED) {
+        uint8_t data[MAX_FILE_SIZE];
+        load_file_data(fp, &ino, data);
+        memset(data + new_size, 0, ino.size - new_size);
+        ino.size = new_size;
+        store_clusters(fp, &ino, data, new_size / CLUSTER_BYTES);
+        write_inode(fp, ino_idx, &ino);
+        store_super(fp);
+        close_image(fp);
+        printf("red: %u bytes removed from %s (new size %u)\n",
+               sub, path, new_size);
+        return;
+    }
+    if (ino.flags & INODE_INLINE) {
+        // keep the tail zeroed so a later ext reads zeros
+        memset((uint8_t *)ino.directPointers + new_size, 0, ino.size - new_size);
+        ino.size = new_size;
+        write_inode(fp, ino_idx, &ino);
+        close_image(fp);
+        printf("red: %u bytes removed from %s (new size %u)\n",
+               sub, path, new_size);
+        return;
+    }
+
     uint32_t old_blocks = (ino.size + BLOCKSIZE - 1) / BLOCKSIZE;
     uint32_t new_blocks = (new_size + BLOCKSIZE - 1) / BLOCKSIZE;
 
@@ -833,10 +2196,25 @@ void cmd_red(const char *img, const char *path, uint32_t sub)
             ino.directPointers[i] = 0;
         }
 
+    // zero the cut-off tail of the new last block so a later ext reads zeros;
+    // this is the one block red modifies, so it is the one that gets unshared
+    uint32_t tail = new_size % BLOCKSIZE;
+    if (tail && ino.directPointers[new_blocks - 1] != HOLE) {
+        uint8_t buf[BLOCKSIZE];
+        read_block(fp, ino.directPointers[new_blocks - 1], buf);
+        memset(buf + tail, 0, BLOCKSIZE - tail);
+        if (is_zero(buf, tail)) {
+            release_block(fp, ino.directPointers[new_blocks - 1]);
+            ino.directPointers[new_blocks - 1] = HOLE;
+        } else {
+            rewrite_block(fp, &ino, new_blocks - 1, buf);
+        }
+    }
+
     ino.size = new_size;
     write_inode(fp, ino_idx, &ino);
     store_super(fp);
-    fclose(fp);
+    close_image(fp);
     printf("red: %u bytes removed from %s (new size %u)\n",
            sub, path, new_size);
 }
@@ -858,12 +2236,9 @@ void du_walk(FILE *fp, uint32_t ino_idx, const char *path)
             strcmp(ent[i].name, ".")  != 0 &&
             strcmp(ent[i].name, "..") != 0)
         {
-            char child_path[1024];
-            if (strcmp(path, "/") == 0)
-                snprintf(child_path, sizeof(child_path), "/%s", ent[i].name);
-            else
-                snprintf(child_path, sizeof(child_path), "%s/%s",
-                         path, ent[i].name);
+            char child_path[strlen(path) + 1 + MAX_FILENAME + 1];
+            strcpy(child_path, path);
+            path_append(child_path, sizeof child_path, ent[i].name);
 
             du_walk(fp, ent[i].inodeIndex, child_path);
         }
@@ -881,143 +2256,2108 @@ void cmd_du(const char *img, const char *path)
 
     du_walk(fp, ino_idx, path);
 
-    fclose(fp);
+    close_image(fp);
 }
 
-void usage()
-{
-    printf("Usage: vfs <imagepath> <command> [args]\n");
-    printf("Commands:\n");
-    printf("\tmkfs <bytes>\t\t\t- create an empty image\n");
-    printf("\tmkdir <path>\t\t\t- create directory at path\n");
-    printf("\trmdir <path>\t\t\t- remove directory at path\n");
-    printf("\tls <path>\t\t\t- list items at path\n");
-    printf("\tdf\t\t\t\t- show disk usage of the image\n");
-    printf("\tlsdf <path>\t\t\t- show disk usage of the pathitem\n");
-    printf("\tcrhl <path> <path>\t\t- create a hard link to file or dir\n");
-    printf("\trm <path>\t\t\t- remove a file or link\n");
-    printf("\text <path> <n>\t\t\t- add n bytes to a file\n");
-    printf("\tred <path> <n>\t\t\t- reduce n bytes from a file\n");
-    printf("\tdu <path>\t\t\t- display info about disk usage\n");
+// --stats reporting
+// the report goes to stderr so it never mixes with command output;
+// "prom:<file>" writes a node_exporter textfile (tmp + rename, so scrapes never see half a file)
+const char *stats_format = NULL;
+const char *stats_cmd = "";
+uint64_t stats_start_ns;
 
-    printf("\tecpt <ext_path> <path>\t\t- external copy to disk\n");
-    printf("\tecpf <path> <ext_path>\t\t- external copy from disk\n");
+typedef struct
+{
+    const char *name;
+    const char *help;
+    uint64_t *value;
+} StatField;
+
+StatField stat_fields[] = {
+    {"read_calls",   "read_at calls",                     &stats.readCalls},
+    {"read_bytes",   "bytes read from the image",         &stats.readBytes},
+    {"write_calls",  "write_at calls",                    &stats.writeCalls},
+    {"write_bytes",  "bytes written to the image",        &stats.writeBytes},
+    {"seeks",        "non-sequential image accesses",     &stats.seeks},
+    {"inode_reads",  "read_inode calls",                  &stats.inodeReads},
+    {"inode_writes", "write_inode calls",                 &stats.inodeWrites},
+    {"block_reads",  "read_block calls",                  &stats.blockReads},
+    {"block_writes", "write_block calls",                 &stats.blockWrites},
+    {"dedup_hits",   "data blocks shared instead of written", &stats.dedupHits},
+    {"cache_hits",   "metadata accesses served from memory", &stats.cacheHits},
+    {"csum_verifies", "blocks verified against their CRC32C", &stats.csumVerifies},
+    {"discards",     "freed blocks punched out of the image", &stats.discards},
+};
+#define STAT_FIELD_CNT (sizeof stat_fields / sizeof stat_fields[0])
+
+void stats_print_table(FILE *out, double secs)
+{
+    fprintf(out, "--- vfs stats: %s (%.3f ms) ---\n", stats_cmd, secs * 1e3);
+    for (uint32_t i = 0; i < STAT_FIELD_CNT; i++)
+        fprintf(out, "%-14s %12llu\n", stat_fields[i].name,
+                (unsigned long long)*stat_fields[i].value);
+
+    fprintf(out, "I/O latency:\n");
+    for (uint32_t b = 0; b < STATS_HIST_BUCKETS; b++) {
+        if (!stats.latency[b]) continue;
+        if (b == STATS_HIST_BUCKETS - 1)
+            fprintf(out, "  >=%6u us %10llu\n", 1u << (b - 1),
+                    (unsigned long long)stats.latency[b]);
+        else
+            fprintf(out, "  < %6u us %10llu\n", 1u << b,
+                    (unsigned long long)stats.latency[b]);
+    }
 }
 
-int main(int argc, char *argv[])
+// the command name comes straight from argv; quotes, backslashes and
+// control characters are escaped for JSON strings and prometheus labels
+void stats_put_escaped(FILE *out, const char *str, bool json)
 {
-    if (argc < 3)
-    {
-        usage();
-        return 1;
+    for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(out, "\\%c", *c);
+        else if (*c == '\n')
+            fputs("\\n", out);
+        else if (json && *c < 0x20)
+            fprintf(out, "\\u%04x", *c);
+        else
+            fputc(*c, out);
     }
+}
 
-    const char *img = argv[1];
-    const char *cmd = argv[2];
+void stats_print_json(FILE *out, double secs)
+{
+    fprintf(out, "{\"command\":\"");
+    stats_put_escaped(out, stats_cmd, true);
+    fprintf(out, "\",\"seconds\":%.9f", secs);
+    for (uint32_t i = 0; i < STAT_FIELD_CNT; i++)
+        fprintf(out, ",\"%s\":%llu", stat_fields[i].name,
+                (unsigned long long)*stat_fields[i].value);
+
+    fprintf(out, ",\"latency_us_buckets\":[");
+    for (uint32_t b = 0; b < STATS_HIST_BUCKETS; b++)
+        fprintf(out, "%s%llu", b ? "," : "", (unsigned long long)stats.latency[b]);
+    fprintf(out, "]}\n");
+}
 
-    if (strcmp(cmd, "mkfs") == 0)
-    {
-        if (argc != 4)
-        {
-            usage();
-            return 1;
-        }
-        cmd_mkfs(img, strtoull(argv[3], NULL, 10));
-        return 0;
+void stats_print_prom(FILE *out, double secs)
+{
+    char *cmd = NULL;
+    size_t cmd_len;
+    FILE *m = open_memstream(&cmd, &cmd_len);
+    if (!m)
+        return;
+    stats_put_escaped(m, stats_cmd, false);
+    fclose(m);
+
+    for (uint32_t i = 0; i < STAT_FIELD_CNT; i++) {
+        fprintf(out, "# HELP vfs_%s_total %s\n", stat_fields[i].name, stat_fields[i].help);
+        fprintf(out, "# TYPE vfs_%s_total counter\n", stat_fields[i].name);
+        fprintf(out, "vfs_%s_total{command=\"%s\"} %llu\n", stat_fields[i].name,
+                cmd, (unsigned long long)*stat_fields[i].value);
     }
-    else if (strcmp(cmd, "mkdir") == 0)
-    {
-        if (argc != 4)
-        {
-            usage();
-            return 1;
-        }
-        cmd_mkdir(img, argv[3]);
-        return 0;
+
+    fprintf(out, "# HELP vfs_command_seconds wall time of the command\n");
+    fprintf(out, "# TYPE vfs_command_seconds gauge\n");
+    fprintf(out, "vfs_command_seconds{command=\"%s\"} %.9f\n", cmd, secs);
+
+    fprintf(out, "# HELP vfs_io_latency_seconds latency of read_at/write_at calls\n");
+    fprintf(out, "# TYPE vfs_io_latency_seconds histogram\n");
+    uint64_t cum = 0;
+    for (uint32_t b = 0; b < STATS_HIST_BUCKETS - 1; b++) {
+        cum += stats.latency[b];
+        fprintf(out, "vfs_io_latency_seconds_bucket{command=\"%s\",le=\"%g\"} %llu\n",
+                cmd, (1u << b) * 1e-6, (unsigned long long)cum);
     }
-    else if (strcmp(cmd, "ls") == 0)
-    {
-        if (argc != 4)
-        {
-            usage();
-            return 1;
-        }
-        cmd_ls(img, argv[3]);
-        return 0;
+    cum += stats.latency[STATS_HIST_BUCKETS - 1];
+    fprintf(out, "vfs_io_latency_seconds_bucket{command=\"%s\",le=\"+Inf\"} %llu\n",
+            cmd, (unsigned long long)cum);
+    fprintf(out, "vfs_io_latency_seconds_sum{command=\"%s\"} %.9f\n",
+            cmd, stats.latencySumNs * 1e-9);
+    fprintf(out, "vfs_io_latency_seconds_count{command=\"%s\"} %llu\n",
+            cmd, (unsigned long long)cum);
+    free(cmd);
+}
+
+void stats_report(void)
+{
+    double secs = (now_ns() - stats_start_ns) * 1e-9;
+
+    if (strcmp(stats_format, "json") == 0) {
+        stats_print_json(stderr, secs);
+    } else if (strcmp(stats_format, "prom") == 0) {
+        stats_print_prom(stderr, secs);
+    } else if (strncmp(stats_format, "prom:", 5) == 0) {
+        const char *path = stats_format + 5;
+        char tmp[1024];
+        snprintf(tmp, sizeof tmp, "%s.tmp", path);
+        FILE *out = fopen(tmp, "w");
+        if (!out) { perror("stats: open"); return; }
+        stats_print_prom(out, secs);
+        fclose(out);
+        if (rename(tmp, path))
+            perror("stats: rename");
+    } else {
+        stats_print_table(stderr, secs);
     }
-    else if(strcmp(cmd, "df") == 0)
-    {
-        if (argc != 3)
-        {
-            usage();
-            return 1;
-        }
-        cmd_df(img);
-        return 0;
+}
+
+// --trace: one TraceRecord per invocation, see vfs_trace.h
+int trace_argc;
+char **trace_argv;
+uint64_t trace_start_wall, trace_start_ns;
+
+void trace_open(const char *path)
+{
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (trace_fd < 0)
+        die("trace: open");
+}
+
+void trace_write(void)
+{
+    if (trace_fd < 0)
+        return;
+    TraceRecord rec = {0};
+    rec.magic = TRACE_MAGIC;
+    rec.startNs = trace_start_wall;
+    rec.durationNs = now_ns() - trace_start_ns;
+    rec.status = exit_status;
+    rec.argc = trace_argc;
+    rec.ioCount = trace_io_cnt;
+
+    size_t arg_bytes = 0;
+    for (int i = 0; i < trace_argc; i++)
+        arg_bytes += strlen(trace_argv[i]) + 1;
+    if (arg_bytes > UINT16_MAX)
+        return;
+    rec.argBytes = arg_bytes;
+
+    size_t len = sizeof rec + arg_bytes + trace_io_cnt * sizeof(TraceIo);
+    uint8_t *buf = malloc(len);
+    if (!buf)
+        return;
+
+    uint8_t *p = buf;
+    memcpy(p, &rec, sizeof rec);
+    p += sizeof rec;
+    for (int i = 0; i < trace_argc; i++) {
+        size_t n = strlen(trace_argv[i]) + 1;
+        memcpy(p, trace_argv[i], n);
+        p += n;
     }
-    else if (strcmp(cmd, "rmdir") == 0)
-    {
-        if (argc != 4)
-        {
-            usage();
-            return 1;
+    memcpy(p, trace_ios, trace_io_cnt * sizeof(TraceIo));
+
+    // a single O_APPEND write keeps records whole when scripts run vfs in parallel
+    if (write(trace_fd, buf, len) != (ssize_t)len)
+        perror("trace: write");
+    free(buf);
+    close(trace_fd);
+}
+
+// copies a file inside the image; with reflink the copy is a new inode
+// sharing the data blocks, which are only copied once either side modifies them
+void cmd_cp(const char *img, const char *src, const char *dst, bool reflink)
+{
+    FILE *fp = open_image_rw(img);
+    load_super(fp);
+
+    uint32_t src_parent;
+    uint32_t src_ino = path_lookup(fp, src, &src_parent, NULL);
+    if (src_ino == src_parent || src_ino == UINT32_MAX)
+        die("cp: source not found");
+
+    Inode ino;
+    read_inode(fp, src_ino, &ino);
+    if (ino.isDirectory)
+        die("cp: cannot copy directories");
+
+    uint32_t dst_parent;
+    char dst_leaf[MAX_FILENAME];
+    uint32_t dst_found = path_lookup(fp, dst, &dst_parent, dst_leaf);
+    if (dst_found == UINT32_MAX)
+        die("cp: destination directory not found");
+    if (dst_found != dst_parent)
+        die("cp: destination already exists");
+
+    Inode parent;
+    read_inode(fp, dst_parent, &parent);
+    if (!parent.isDirectory) die("cp: dest-parent not a directory");
+
+    uint32_t new_idx = alloc_inode(fp, dst_parent);
+    if (new_idx == UINT32_MAX) die("cp: no free inodes");
+    sb.freeInodeCount--;
+    alloc_goal = parent.directPointers[0];
+
+    Inode copy = ino;
+    copy.linkCount = 1;
+
+    if (reflink && !(ino.flags & INODE_INLINE)) {
+        if (!sb.refcountBlocks) {
+            sb.refcountBlocks = refcount_table_blocks(sb.totalBlockCount);
+            sb.refcountStart = create_table(fp, sb.refcountBlocks);
         }
-        cmd_rmdir(img, argv[3]);
-        return 0; 
-    }else if (strcmp(cmd, "ecpt") == 0)
-    {
-        if (argc != 5)
-        {
-            usage();
-            return 1;
+        // O(metadata): one refcount bump per block, no data is read or written
+        uint8_t buf[BLOCKSIZE];
+        for (uint32_t i = 0; i < DIRECTBLOCK_CNT; i++) {
+            uint32_t b = ino.directPointers[i];
+            if (b && !refcount_inc(fp, b)) {
+                // share count saturated, this block gets a private copy
+                read_block(fp, b, buf);
+                copy.directPointers[i] = store_block(fp, buf);
+            }
         }
-        cmd_ecpt(img, argv[3], argv[4]);
-        return 0;
+    } else if (!(ino.flags & INODE_INLINE)) {
+        uint8_t data[MAX_FILE_SIZE];
+        load_file_data(fp, &ino, data);
+        store_file_data(fp, &copy, data, ino.size, ino.flags & INODE_COMPRESSED);
     }
-    else if (strcmp(cmd, "ecpf") == 0)
-    {
-        if (argc != 5)
-        {
-            usage();
-            return 1;
-        }
-        cmd_ecpf(img, argv[3], argv[4]);
-        return 0;
+    write_inode(fp, new_idx, &copy);
+
+    if (add_entry_to_dir(fp, &parent, dst_parent, dst_leaf, new_idx) < 0)
+        die("cp: parent directory full");
+
+    store_super(fp);
+    close_image(fp);
+    printf("cp: copied %s -> %s%s\n", src, dst, reflink ? " (reflink)" : "");
+}
+
+void cmd_dedup_scan(const char *img, uint32_t rate)
+{
+    FILE *fp = open_image_rw(img);
+    load_super(fp);
+
+    // images made without dedup get their tables now and keep dedup on from here
+    bool enable = !(sb.featureFlags & FEATURE_DEDUP);
+    if (!sb.refcountBlocks) {
+        sb.refcountBlocks = refcount_table_blocks(sb.totalBlockCount);
+        sb.refcountStart = create_table(fp, sb.refcountBlocks);
     }
-    else if (strcmp(cmd, "lsdf") == 0)
-    {
-        if (argc != 4) { usage(); return 1; }
-        cmd_lsdf(img, argv[3]);
-        return 0;
+    if (!sb.dedupIndexBlocks) {
+        sb.dedupIndexBlocks = dedup_index_blocks(sb.totalBlockCount);
+        sb.dedupIndexStart = create_table(fp, sb.dedupIndexBlocks);
     }
-    else if (strcmp(cmd, "crhl") == 0)
-    {
-        if (argc != 5) { usage(); return 1; }
-        cmd_crhl(img, argv[3], argv[4]);
-        return 0;
+    sb.featureFlags |= FEATURE_DEDUP;
+    if (enable) // a rescan that finds nothing new must not bump the generation
+        store_super(fp);
+
+    uint8_t ibmp[INODE_COUNT / 8];
+    read_at(fp, INODE_BITMAP_OFFSET, ibmp, sizeof ibmp);
+
+    uint32_t scanned = 0, merged = 0;
+    uint32_t free_before = sb.freeBlockCount;
+    uint8_t buf[BLOCKSIZE];
+
+    for (uint32_t i = 1; i < INODE_COUNT; i++) {
+        if (!(ibmp[i / 8] & (1 << (i & 7))))
+            continue;
+        Inode ino;
+        read_inode(fp, i, &ino);
+        if (ino.isDirectory || (ino.flags & INODE_INLINE))
+            continue;
+
+        for (uint32_t k = 0; k < DIRECTBLOCK_CNT; k++) {
+            uint32_t p = ino.directPointers[k];
+            if (!p)
+                continue;
+            read_block(fp, p, buf);
+            uint32_t hash = block_hash(buf);
+            uint32_t b = dedup_lookup(fp, buf, hash);
+            scanned++;
+
+            if (b == UINT32_MAX) {
+                dedup_insert(fp, p, hash);
+            } else if (b != p && refcount_inc(fp, b)) {
+                // reference the twin before dropping ours: an interrupted
+                // scan leaks at most one reference, it never loses data
+                ino.directPointers[k] = b;
+                write_inode(fp, i, &ino);
+                release_block(fp, p);
+                store_super(fp);
+                merged++;
+            }
+
+            if (rate)
+                usleep(1000000 / rate);
+        }
     }
-    else if (strcmp(cmd, "rm") == 0)
-    {
-        if (argc != 4) { usage(); return 1; }
-        cmd_rm(img, argv[3]);
+
+    close_image(fp);
+    printf("dedup-scan: %u blocks scanned, %u shared, %u blocks freed\n",
+           scanned, merged, sb.freeBlockCount - free_before);
+}
+
+// ---------------------------------------------------------------------------
+// fragmentation: a file's fragments are the physically contiguous runs its
+// data blocks form in slot order; holes and inline data don't count
+// ---------------------------------------------------------------------------
+#define FREE_HIST_BUCKETS 14 // free extents of 1, 2-3, 4-7, ... 8192 blocks
+
+typedef struct
+{
+    bool defrag;
+    uint32_t rate; // blocks/s, 0 = unlimited
+    uint32_t files, fragmented, fragments;
+    uint32_t relocated, moved, skipped;
+} FragState;
+
+uint32_t file_fragments(const Inode *ino, uint32_t *blocks)
+{
+    uint32_t frags = 0, prev = 0;
+    *blocks = 0;
+    if (ino->flags & INODE_INLINE)
         return 0;
+    for (uint32_t i = 0; i < DIRECTBLOCK_CNT; i++) {
+        uint32_t b = ino->directPointers[i];
+        if (b == HOLE)
+            continue;
+        if (!*blocks || b != prev + 1)
+            frags++;
+        prev = b;
+        (*blocks)++;
     }
-    else if (strcmp(cmd, "ext") == 0)
-    {
-        if (argc != 5) { usage(); return 1; }
-        cmd_ext(img, argv[3], (uint32_t)strtoul(argv[4], NULL, 10));
-        return 0;
+    return frags;
+}
+
+// moves the data of a file into one contiguous run near goal. the copy is
+// complete before the inode is switched over and the old blocks are only
+// freed after that, so an interrupted defrag leaks at most one run and
+// never loses data. shared blocks are left alone, moving them would
+// unshare them
+bool defrag_file(FILE *fp, uint32_t ino_idx, Inode *ino, uint32_t blocks, uint32_t goal, FragState *st)
+{
+    for (uint32_t i = 0; i < DIRECTBLOCK_CNT; i++)
+        if (ino->directPointers[i] && refcount_get(fp, ino->directPointers[i]))
+            return false;
+
+    uint32_t run = alloc_run(fp, blocks, goal);
+    if (run == UINT32_MAX)
+        return false;
+    sb.freeBlockCount -= blocks;
+
+    Inode moved = *ino;
+    uint8_t buf[BLOCKSIZE];
+    for (uint32_t i = 0, n = 0; i < DIRECTBLOCK_CNT; i++) {
+        if (ino->directPointers[i] == HOLE)
+            continue;
+        read_block(fp, ino->directPointers[i], buf);
+        write_block(fp, run + n, buf);
+        if (sb.featureFlags & FEATURE_DEDUP)
+            dedup_insert(fp, run + n, block_hash(buf));
+        moved.directPointers[i] = run + n++;
+        if (st->rate)
+            usleep(1000000 / st->rate);
     }
-    else if (strcmp(cmd, "red") == 0)
-    {
-        if (argc != 5) { usage(); return 1; }
-        cmd_red(img, argv[3], (uint32_t)strtoul(argv[4], NULL, 10));
-        return 0;
+    fflush(fp);
+    write_inode(fp, ino_idx, &moved);
+    fflush(fp);
+
+    for (uint32_t i = 0; i < DIRECTBLOCK_CNT; i++)
+        if (ino->directPointers[i])
+            release_block(fp, ino->directPointers[i]);
+    store_super(fp);
+
+    *ino = moved;
+    st->moved += blocks;
+    return true;
+}
+
+void frag_walk(FILE *fp, uint32_t ino_idx, const char *path, uint32_t goal, FragState *st)
+{
+    Inode ino;
+    read_inode(fp, ino_idx, &ino);
+
+    if (!ino.isDirectory) {
+        uint32_t blocks;
+        uint32_t frags = file_fragments(&ino, &blocks);
+        st->files++;
+        if (frags > 1) {
+            st->fragmented++;
+            if (st->defrag) {
+                if (defrag_file(fp, ino_idx, &ino, blocks, goal, st))
+                    st->relocated++;
+                else
+                    st->skipped++;
+                frags = file_fragments(&ino, &blocks);
+            }
+        }
+        st->fragments += frags;
+        printf("%u\t%u\t%s\n", frags, blocks, path);
+        return;
     }
-    else if (strcmp(cmd, "du") == 0)
-    {
-        if(argc != 4) { usage(); return 1; }
-        cmd_du(img, argv[3]);
+
+    DirectoryEntry ent[DIRS_PER_BLOCK];
+    read_block(fp, ino.directPointers[0], ent);
+
+    for (uint32_t i = 0; i < DIRS_PER_BLOCK; i++)
+        if (ent[i].inodeIndex &&
+            strcmp(ent[i].name, ".")  != 0 &&
+            strcmp(ent[i].name, "..") != 0)
+        {
+            char child_path[strlen(path) + 1 + MAX_FILENAME + 1];
+            strcpy(child_path, path);
+            path_append(child_path, sizeof child_path, ent[i].name);
+
+            frag_walk(fp, ent[i].inodeIndex, child_path, ino.directPointers[0], st);
+        }
+}
+
+// histogram of free extents by log2 length, from one read of the bitmap
+void free_extents(FILE *fp, uint32_t hist[FREE_HIST_BUCKETS], uint32_t *largest)
+{
+    uint8_t bmp[BLOCKSIZE];
+    uint32_t count = sb.totalBlockCount < BLOCKSIZE * 8 ? sb.totalBlockCount : BLOCKSIZE * 8;
+    read_at(fp, BLOCK_BITMAP_OFFSET, bmp, (count + 7) / 8);
+
+    memset(hist, 0, FREE_HIST_BUCKETS * sizeof *hist);
+    *largest = 0;
+    uint32_t run = 0;
+    for (uint32_t i = 0; i <= count; i++) {
+        if (i < count && !(bmp[i / 8] & (1 << (i & 7)))) {
+            run++;
+            continue;
+        }
+        if (run) {
+            uint32_t b = 0;
+            while (b < FREE_HIST_BUCKETS - 1 && (run >> (b + 1)))
+                b++;
+            hist[b]++;
+            if (run > *largest)
+                *largest = run;
+        }
+        run = 0;
+    }
+}
+
+// frag lists "fragments blocks path" per file plus a free space summary;
+// defrag additionally relocates every fragmented file, rate-limited to
+// rate blocks/s when given
+void cmd_frag(const char *img, const char *path, bool defrag, uint32_t rate)
+{
+    FILE *fp = open_image_rw(img);
+    load_super(fp);
+
+    uint32_t parent_idx;
+    uint32_t ino_idx = path_lookup(fp, path, &parent_idx, NULL);
+    if (ino_idx == UINT32_MAX || (ino_idx == parent_idx && strcmp(path, "/") != 0))
+        die(defrag ? "defrag: path not found" : "frag: path not found");
+
+    Inode parent;
+    read_inode(fp, parent_idx, &parent);
+
+    FragState st = {.defrag = defrag, .rate = rate};
+    frag_walk(fp, ino_idx, path, parent.directPointers[0], &st);
+
+    uint32_t hist[FREE_HIST_BUCKETS], largest;
+    free_extents(fp, hist, &largest);
+
+    printf("files: %u, fragmented: %u, fragments: %u\n", st.files, st.fragmented, st.fragments);
+    if (defrag)
+        printf("defrag: %u files relocated, %u blocks moved, %u skipped\n",
+               st.relocated, st.moved, st.skipped);
+    printf("free extents (largest %u blocks):\n", largest);
+    for (uint32_t b = 0; b < FREE_HIST_BUCKETS; b++)
+        if (hist[b])
+            printf("  %5u-%-5u %u\n", 1u << b, (2u << b) - 1, hist[b]);
+
+    close_image(fp); // defrag_file stores the superblock, a report writes nothing
+}
+
+// ---------------------------------------------------------------------------
+// import: a host tree is listed up front, a pool of threads reads the files
+// ahead while the main thread creates everything in listing order (parents
+// before children) with the image in bulk mode
+// ---------------------------------------------------------------------------
+#define IMPORT_WINDOW 256 // files read ahead of the writer at most
+
+enum { IMPORT_PENDING, IMPORT_READY, IMPORT_FAILED };
+
+typedef struct
+{
+    char *host;     // host path
+    char *name;     // leaf name in the image
+    int32_t parent; // entry of the parent directory, -1 = the target directory
+    bool dir;
+    uint32_t size;
+    uint32_t ino;   // inode once created
+    uint8_t *data;  // file content, filled by a reader
+    int state;      // IMPORT_*
+} ImportEntry;
+
+typedef struct
+{
+    ImportEntry *ents;
+    uint32_t count, cap;
+    uint32_t skipped;
+    uint32_t next; // next entry a reader picks up
+    uint32_t done; // entries the writer is through with
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ImportQueue;
+
+void import_add(ImportQueue *q, const char *host, const char *name, int32_t parent, bool dir, uint32_t size)
+{
+    if (q->count == q->cap) {
+        q->cap = q->cap ? q->cap * 2 : 256;
+        q->ents = realloc(q->ents, q->cap * sizeof *q->ents);
+        if (!q->ents)
+            die("realloc");
+    }
+    ImportEntry *e = &q->ents[q->count++];
+    memset(e, 0, sizeof *e);
+    e->host = strdup(host);
+    e->name = strdup(name);
+    if (!e->host || !e->name)
+        die("strdup");
+    e->parent = parent;
+    e->dir = dir;
+    e->size = size;
+    e->state = dir ? IMPORT_READY : IMPORT_PENDING;
+}
+
+// lists dir depth first; what the image can't hold is reported and skipped
+void import_list(ImportQueue *q, const char *dir, int32_t parent)
+{
+    DIR *d = opendir(dir);
+    if (!d)
+        die("import: opendir");
+
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        char path[4096];
+        snprintf(path, sizeof path, "%s/%s", dir, de->d_name);
+
+        struct stat st;
+        if (lstat(path, &st) < 0)
+            die("import: stat");
+        const char *why = NULL;
+        if (strlen(de->d_name) >= MAX_FILENAME)
+            why = "name too long";
+        else if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+            why = "not a regular file";
+        else if (S_ISREG(st.st_mode) && st.st_size > MAX_FILE_SIZE)
+            why = "file too large for this FS (max 12 KiB)";
+        if (why) {
+            fprintf(stderr, "import: skipping %s: %s\n", path, why);
+            q->skipped++;
+            continue;
+        }
+
+        import_add(q, path, de->d_name, parent, S_ISDIR(st.st_mode), (uint32_t)st.st_size);
+        if (S_ISDIR(st.st_mode))
+            import_list(q, path, (int32_t)q->count - 1);
+    }
+    closedir(d);
+}
+
+void *import_reader(void *arg)
+{
+    ImportQueue *q = arg;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (q->next < q->count && q->next >= q->done + IMPORT_WINDOW)
+            pthread_cond_wait(&q->cond, &q->lock);
+        if (q->next >= q->count)
+            break;
+        ImportEntry *e = &q->ents[q->next++];
+        if (e->dir)
+            continue;
+        pthread_mutex_unlock(&q->lock);
+
+        // the writer die()s on failures, a reader only reports them
+        int state = IMPORT_FAILED;
+        uint8_t *data = malloc(MAX_FILE_SIZE);
+        FILE *hf = data ? fopen(e->host, "rb") : NULL;
+        if (hf && read_host_sparse(hf, data, e->size) == 0)
+            state = IMPORT_READY;
+        if (hf)
+            fclose(hf);
+
+        pthread_mutex_lock(&q->lock);
+        e->data = data;
+        e->state = state;
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+// refuses the import up front when it can't complete: a name taken in the
+// target directory, a directory with more entries than its block holds, or
+// too few inodes or blocks. the block count is exact for plain images; with
+// dedup or compression it is an upper bound, so it is only checked there as
+// far as it is certain (one block per directory)
+void import_check(FILE *fp, ImportQueue *q, const Inode *tino)
+{
+    DirectoryEntry blk[DIRS_PER_BLOCK];
+    read_block(fp, tino->directPointers[0], blk);
+    uint32_t target_free = 0;
+    for (uint32_t i = 0; i < DIRS_PER_BLOCK; i++)
+        if (blk[i].inodeIndex == 0)
+            target_free++;
+
+    uint32_t *children = calloc(q->count + 1, sizeof *children); // [0]: the target
+    if (!children)
+        die("calloc");
+    uint64_t blocks = 0;
+    bool exact = !(sb.featureFlags & (FEATURE_DEDUP | FEATURE_COMPRESS));
+    for (uint32_t i = 0; i < q->count; i++) {
+        ImportEntry *e = &q->ents[i];
+        children[e->parent + 1]++;
+        if (e->parent < 0 && find_entry_in_block(blk, e->name, NULL) == 0) {
+            fprintf(stderr, "import: %s\n", e->host);
+            die("import: destination already exists");
+        }
+        if (e->dir)
+            blocks++;
+        else if (exact && e->size > INLINE_MAX)
+            blocks += (e->size + BLOCKSIZE - 1) / BLOCKSIZE;
+    }
+
+    bool full = children[0] > target_free;
+    for (uint32_t i = 0; i < q->count; i++)
+        if (q->ents[i].dir && children[i + 1] > DIRS_PER_BLOCK - 2) { // . and ..
+            fprintf(stderr, "import: %s\n", q->ents[i].host);
+            full = true;
+        }
+    free(children);
+    if (full) {
+        errno = ENOSPC;
+        die("import: directory full");
+    }
+    if (q->count > sb.freeInodeCount) {
+        errno = ENOSPC;
+        die("import: not enough free inodes");
+    }
+    if (blocks > sb.freeBlockCount) {
+        errno = ENOSPC;
+        die("import: not enough free blocks");
+    }
+}
+
+void cmd_import(const char *img, const char *host_dir, const char *vfs_dir, uint32_t threads)
+{
+    FILE *fp = open_image_rw(img);
+    // a large stdio buffer on top of the coalesced runs; must precede any I/O on fp
+    setvbuf(fp, NULL, _IOFBF, RUN_MAX_BLOCKS * BLOCKSIZE);
+    load_super(fp);
+
+    uint32_t parent_idx;
+    uint32_t target = path_lookup(fp, vfs_dir, &parent_idx, NULL);
+    if (target == UINT32_MAX || (target == parent_idx && strcmp(vfs_dir, "/") != 0))
+        die("import: destination not found");
+    Inode tino;
+    read_inode(fp, target, &tino);
+    if (!tino.isDirectory)
+        die("import: destination not a directory");
+
+    ImportQueue q = {0};
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.cond, NULL);
+    import_list(&q, host_dir, -1);
+    import_check(fp, &q, &tino);
+
+    uint64_t t0 = now_ns(), last = t0;
+    pthread_t *tid = calloc(threads, sizeof *tid);
+    if (!tid)
+        die("calloc");
+    for (uint32_t t = 0; t < threads; t++)
+        if (pthread_create(&tid[t], NULL, import_reader, &q))
+            die("import: pthread_create");
+
+    bulk_begin(fp);
+
+    uint32_t files = 0, dirs = 0;
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < q.count; i++) {
+        ImportEntry *e = &q.ents[i];
+        pthread_mutex_lock(&q.lock);
+        while (e->state == IMPORT_PENDING)
+            pthread_cond_wait(&q.cond, &q.lock);
+        pthread_mutex_unlock(&q.lock);
+
+        if (e->state == IMPORT_FAILED) {
+            fprintf(stderr, "import: %s\n", e->host);
+            die("import: read host file");
+        }
+
+        uint32_t pidx = e->parent < 0 ? target : q.ents[e->parent].ino;
+        Inode parent;
+        read_inode(fp, pidx, &parent);
+        DirectoryEntry blk[DIRS_PER_BLOCK];
+        read_block(fp, parent.directPointers[0], blk);
+        if (find_entry_in_block(blk, e->name, NULL) == 0) {
+            fprintf(stderr, "import: %s\n", e->host);
+            die("import: destination already exists");
+        }
+
+        if (e->dir) {
+            e->ino = make_dir(fp, &parent, pidx, e->name);
+            dirs++;
+        } else {
+            e->ino = make_file(fp, &parent, pidx, e->name, e->data, e->size, false);
+            files++;
+            bytes += e->size;
+        }
+        free(e->data);
+        e->data = NULL;
+
+        pthread_mutex_lock(&q.lock);
+        q.done = i + 1;
+        pthread_cond_broadcast(&q.cond);
+        pthread_mutex_unlock(&q.lock);
+
+        uint64_t t = now_ns();
+        if (t - last >= 1000000000ull) {
+            fprintf(stderr, "import: %u/%u entries, %.1f MiB/s\n", i + 1, q.count,
+                    bytes / ((t - t0) / 1e9) / (1024.0 * 1024.0));
+            last = t;
+        }
+    }
+
+    for (uint32_t t = 0; t < threads; t++)
+        pthread_join(tid[t], NULL);
+    free(tid);
+
+    bulk_end(); // stores the superblock along with the bitmaps
+    close_image(fp);
+
+    double secs = (now_ns() - t0) / 1e9;
+    printf("import: %u files, %u directories, %llu bytes in %.3f s (%.1f MiB/s, %.0f files/s), %u skipped\n",
+           files, dirs, (unsigned long long)bytes, secs,
+           bytes / secs / (1024.0 * 1024.0), (files + dirs) / secs, q.skipped);
+
+    for (uint32_t i = 0; i < q.count; i++) {
+        free(q.ents[i].host);
+        free(q.ents[i].name);
+    }
+    free(q.ents);
+}
+
+// ---------------------------------------------------------------------------
+// export: a subtree as a POSIX ustar stream. names are the image paths
+// without the leading '/', names that don't fit the header get a pax
+// extended header, and every further path of an inode becomes a hard link
+// entry pointing at the first one
+// ---------------------------------------------------------------------------
+#define TAR_BLOCK 512
+#define TAR_RECORD (20 * TAR_BLOCK)
+
+typedef struct
+{
+    FILE *out;
+    uint64_t written;
+    char *seen[INODE_COUNT]; // first path exported for each inode
+    uint32_t files, dirs, links;
+    uint64_t bytes;
+    uint32_t mtime;
+} TarState;
+
+void tar_write(TarState *t, const void *buf, size_t n)
+{
+    if (fwrite(buf, 1, n, t->out) != n)
+        die("export: write");
+    t->written += n;
+}
+
+void tar_pad(TarState *t)
+{
+    static const uint8_t zero[TAR_BLOCK];
+    if (t->written % TAR_BLOCK)
+        tar_write(t, zero, TAR_BLOCK - t->written % TAR_BLOCK);
+}
+
+void tar_header(TarState *t, const char *name, char type, uint32_t size, const char *link)
+{
+    uint8_t h[TAR_BLOCK] = {0};
+    strncpy((char *)h, name, 100);
+    snprintf((char *)h + 100, 8, "%07o", type == '5' ? 0755 : 0644);
+    snprintf((char *)h + 108, 8, "%07o", 0);
+    snprintf((char *)h + 116, 8, "%07o", 0);
+    snprintf((char *)h + 124, 12, "%011o", size);
+    snprintf((char *)h + 136, 12, "%011o", t->mtime);
+    h[156] = type;
+    if (link)
+        strncpy((char *)h + 157, link, 100);
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+
+    uint32_t sum = 0;
+    memset(h + 148, ' ', 8);
+    for (uint32_t i = 0; i < TAR_BLOCK; i++)
+        sum += h[i];
+    snprintf((char *)h + 148, 8, "%06o", sum);
+    tar_write(t, h, TAR_BLOCK);
+}
+
+// pax records are "<len> key=value\n" with len counting itself
+size_t pax_len(const char *key, const char *val)
+{
+    size_t body = strlen(key) + strlen(val) + 3; // ' ', '=', '\n'
+    size_t len = body + 1;
+    while (len != body + (size_t)snprintf(NULL, 0, "%zu", len))
+        len = body + snprintf(NULL, 0, "%zu", len);
+    return len;
+}
+
+// written straight to the stream, so a path of any length fits
+void pax_record(TarState *t, const char *key, const char *val)
+{
+    char len[24];
+    snprintf(len, sizeof len, "%zu ", pax_len(key, val));
+    tar_write(t, len, strlen(len));
+    tar_write(t, key, strlen(key));
+    tar_write(t, "=", 1);
+    tar_write(t, val, strlen(val));
+    tar_write(t, "\n", 1);
+}
+
+void tar_entry(TarState *t, const char *name, char type, uint32_t size, const char *link)
+{
+    bool long_name = strlen(name) >= 100, long_link = link && strlen(link) >= 100;
+    if (long_name || long_link) {
+        size_t used = (long_name ? pax_len("path", name) : 0) +
+                      (long_link ? pax_len("linkpath", link) : 0);
+        tar_header(t, "PaxHeader", 'x', (uint32_t)used, NULL);
+        if (long_name)
+            pax_record(t, "path", name);
+        if (long_link)
+            pax_record(t, "linkpath", link);
+        tar_pad(t);
+    }
+    tar_header(t, name, type, size, link);
+}
+
+// asks the kernel to start reading the data runs of a file ahead of use
+void readahead_file(FILE *fp, const Inode *ino)
+{
+    if (ino->isDirectory || (ino->flags & INODE_INLINE))
+        return;
+    for (uint32_t i = 0, n; i < DIRECTBLOCK_CNT; i += n) {
+        uint32_t b = ino->directPointers[i];
+        for (n = 1; i + n < DIRECTBLOCK_CNT && b != HOLE && ino->directPointers[i + n] == b + n; n++)
+            ;
+        if (b != HOLE)
+            posix_fadvise(fileno(fp), (off_t)b * BLOCKSIZE, (off_t)n * BLOCKSIZE, POSIX_FADV_WILLNEED);
+    }
+}
+
+void export_walk(FILE *fp, TarState *t, uint32_t ino_idx, const char *path)
+{
+    Inode ino;
+    read_inode(fp, ino_idx, &ino);
+    const char *name = path + 1; // archive names are relative
+
+    if (t->seen[ino_idx]) {
+        if (ino.isDirectory) { // tar has no directory hard links
+            fprintf(stderr, "export: skipping %s: directory already exported as %s\n",
+                    path, t->seen[ino_idx]);
+            return;
+        }
+        tar_entry(t, name, '1', 0, t->seen[ino_idx]);
+        t->links++;
+        return;
+    }
+    t->seen[ino_idx] = strdup(name);
+    if (!t->seen[ino_idx])
+        die("strdup");
+
+    if (!ino.isDirectory) {
+        static uint8_t data[MAX_FILE_SIZE];
+        load_file_data(fp, &ino, data);
+        tar_entry(t, name, '0', ino.size, NULL);
+        tar_write(t, data, ino.size);
+        tar_pad(t);
+        t->files++;
+        t->bytes += ino.size;
+        return;
+    }
+
+    if (*name) { // the root itself has no name in the archive
+        char dname[strlen(name) + 2];
+        strcpy(dname, name);
+        strcat(dname, "/");
+        tar_entry(t, dname, '5', 0, NULL);
+        t->dirs++;
+    }
+
+    DirectoryEntry ent[DIRS_PER_BLOCK];
+    read_block(fp, ino.directPointers[0], ent);
+
+    // start reading all children before the first one is needed
+    for (uint32_t i = 0; i < DIRS_PER_BLOCK; i++)
+        if (ent[i].inodeIndex && strcmp(ent[i].name, ".") && strcmp(ent[i].name, "..")) {
+            Inode child;
+            read_inode(fp, ent[i].inodeIndex, &child);
+            readahead_file(fp, &child);
+        }
+
+    for (uint32_t i = 0; i < DIRS_PER_BLOCK; i++)
+        if (ent[i].inodeIndex &&
+            strcmp(ent[i].name, ".")  != 0 &&
+            strcmp(ent[i].name, "..") != 0)
+        {
+            char child_path[strlen(path) + 1 + MAX_FILENAME + 1];
+            strcpy(child_path, path);
+            path_append(child_path, sizeof child_path, ent[i].name);
+
+            export_walk(fp, t, ent[i].inodeIndex, child_path);
+        }
+}
+
+// writes path and everything below it as a tar stream to out ("-" = stdout);
+// nothing but the archive goes to stdout in that case
+void cmd_export(const char *img, const char *path, const char *out)
+{
+    FILE *fp = open_image_rw(img);
+    load_super(fp);
+
+    uint32_t parent_idx;
+    uint32_t ino_idx = path_lookup(fp, path, &parent_idx, NULL);
+    if (ino_idx == UINT32_MAX || (ino_idx == parent_idx && strcmp(path, "/") != 0))
+        die("export: path not found");
+
+    bool to_stdout = strcmp(out, "-") == 0;
+    TarState t = {.out = to_stdout ? stdout : fopen(out, "wb"), .mtime = (uint32_t)time(NULL)};
+    if (!t.out)
+        die("export: open output");
+    setvbuf(t.out, NULL, _IOFBF, TAR_RECORD * 8);
+
+    export_walk(fp, &t, ino_idx, path);
+
+    // end of archive: two zero blocks, padded to a whole record
+    static const uint8_t zero[TAR_RECORD];
+    tar_write(&t, zero, 2 * TAR_BLOCK);
+    if (t.written % TAR_RECORD)
+        tar_write(&t, zero, TAR_RECORD - t.written % TAR_RECORD);
+    if (fflush(t.out))
+        die("export: write");
+    if (!to_stdout)
+        fclose(t.out);
+
+    for (uint32_t i = 0; i < INODE_COUNT; i++)
+        free(t.seen[i]);
+    close_image(fp);
+
+    if (!to_stdout)
+        printf("export: %u files, %u directories, %u hard links, %llu bytes -> %s\n",
+               t.files, t.dirs, t.links, (unsigned long long)t.bytes, out);
+}
+
+// ---------------------------------------------------------------------------
+// put: stores a stream of unknown length (a pipe, stdin) block by block as
+// it arrives. with -t a second thread keeps reading the source into a small
+// ring of blocks while the main thread writes the image
+// ---------------------------------------------------------------------------
+#define PUT_RING 8
+
+typedef struct
+{
+    int fd;
+    bool threaded;
+    uint8_t buf[PUT_RING][BLOCKSIZE];
+    uint32_t len[PUT_RING];
+    uint32_t head, tail; // blocks filled / taken
+    bool eof;
+    int err;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} StreamSrc;
+
+// reads up to n bytes, short only at end of input; -1 on errors
+ssize_t read_full(int fd, uint8_t *buf, size_t n)
+{
+    size_t got = 0;
+    while (got < n) {
+        ssize_t r = read(fd, buf + got, n - got);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            break;
+        got += r;
+    }
+    return got;
+}
+
+void *stream_reader(void *arg)
+{
+    StreamSrc *s = arg;
+
+    pthread_mutex_lock(&s->lock);
+    while (!s->eof) {
+        while (s->head - s->tail == PUT_RING)
+            pthread_cond_wait(&s->cond, &s->lock);
+        uint32_t slot = s->head % PUT_RING;
+        pthread_mutex_unlock(&s->lock);
+
+        ssize_t n = read_full(s->fd, s->buf[slot], BLOCKSIZE);
+
+        pthread_mutex_lock(&s->lock);
+        if (n < 0)
+            s->err = errno;
+        if (n > 0) {
+            s->len[slot] = (uint32_t)n;
+            s->head++;
+        }
+        if (n < BLOCKSIZE)
+            s->eof = true;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+// next block of the stream into out; returns its length, 0 at the end
+uint32_t stream_next(StreamSrc *s, uint8_t *out)
+{
+    if (!s->threaded) {
+        ssize_t n = s->eof ? 0 : read_full(s->fd, out, BLOCKSIZE);
+        if (n < 0)
+            die("put: read");
+        s->eof = n < BLOCKSIZE;
+        return (uint32_t)n;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    while (s->head == s->tail && !s->eof)
+        pthread_cond_wait(&s->cond, &s->lock);
+    uint32_t n = 0;
+    if (s->head != s->tail) {
+        uint32_t slot = s->tail % PUT_RING;
+        n = s->len[slot];
+        memcpy(out, s->buf[slot], n);
+        s->tail++;
+        pthread_cond_broadcast(&s->cond);
+    }
+    int err = s->err;
+    pthread_mutex_unlock(&s->lock);
+
+    if (!n && err) {
+        errno = err;
+        die("put: read");
+    }
+    return n;
+}
+
+void cmd_put(const char *img, const char *host_path, const char *vfs_path, bool threaded, bool compress)
+{
+    FILE *fp = open_image_rw(img);
+    load_super(fp);
+
+    uint32_t parent_idx;
+    char leaf[MAX_FILENAME];
+    uint32_t found = path_lookup(fp, vfs_path, &parent_idx, leaf);
+    if (found == UINT32_MAX)
+        die("put: destination directory not found");
+    if (found != parent_idx)
+        die("put: destination already exists");
+    Inode parent;
+    read_inode(fp, parent_idx, &parent);
+    if (!parent.isDirectory) die("put: dest-parent not a directory");
+
+    // a stream can't be rewound, so fail before consuming it
+    DirectoryEntry ents[DIRS_PER_BLOCK];
+    read_block(fp, parent.directPointers[0], ents);
+    uint32_t slot = 0;
+    while (slot < DIRS_PER_BLOCK && ents[slot].inodeIndex)
+        slot++;
+    if (slot == DIRS_PER_BLOCK || !sb.freeInodeCount)
+        die("put: parent directory full or no free inodes");
+
+    static StreamSrc src;
+    src.fd = strcmp(host_path, "-") == 0 ? STDIN_FILENO : open(host_path, O_RDONLY);
+    if (src.fd < 0)
+        die("put: open host file");
+    src.threaded = threaded;
+    pthread_t tid;
+    if (threaded) {
+        pthread_mutex_init(&src.lock, NULL);
+        pthread_cond_init(&src.cond, NULL);
+        if (pthread_create(&tid, NULL, stream_reader, &src))
+            die("put: pthread_create");
+    }
+
+    Inode ino = {0};
+    ino.linkCount = 1;
+    compress = compress || (sb.featureFlags & FEATURE_COMPRESS);
+    alloc_goal = parent.directPointers[0]; // data goes near the directory
+
+    // a block is stored once the next one has started arriving: only at the
+    // end is it known whether the file fits inline. compressed files are
+    // collected first, clusters need all of their data
+    static uint8_t data[MAX_FILE_SIZE];
+    uint8_t cur[BLOCKSIZE], next[BLOCKSIZE];
+    uint32_t size = 0, k = 0;
+    uint32_t n = stream_next(&src, cur);
+
+    while (n) {
+        if (k == DIRECTBLOCK_CNT) {
+            release_data(fp, &ino); // nothing of the file stays behind
+            errno = EFBIG;
+            die("put: file too large for this FS (max 12 KiB)");
+        }
+        uint32_t nn = n == BLOCKSIZE ? stream_next(&src, next) : 0;
+
+        memset(cur + n, 0, BLOCKSIZE - n);
+        if (compress || (k == 0 && !nn && n <= INLINE_MAX))
+            memcpy(data + k * BLOCKSIZE, cur, n);
+        else if (!is_zero(cur, BLOCKSIZE)) // zero blocks stay holes
+            ino.directPointers[k] = store_block(fp, cur);
+
+        size += n;
+        k++;
+        memcpy(cur, next, nn);
+        n = nn;
+    }
+    if (threaded)
+        pthread_join(tid, NULL);
+    if (src.fd != STDIN_FILENO)
+        close(src.fd);
+
+    if (compress || size <= INLINE_MAX)
+        store_file_data(fp, &ino, data, size, compress);
+    ino.size = size;
+
+    uint32_t ino_idx = alloc_inode(fp, parent_idx);
+    if (ino_idx == UINT32_MAX) {
+        release_data(fp, &ino);
+        die("put: no free inodes");
+    }
+    sb.freeInodeCount--;
+    write_inode(fp, ino_idx, &ino);
+    if (add_entry_to_dir(fp, &parent, parent_idx, leaf, ino_idx) < 0)
+        die("put: parent directory full");
+
+    store_super(fp);
+    close_image(fp);
+    printf("put: %u bytes -> %s\n", size, vfs_path);
+}
+
+// ---------------------------------------------------------------------------
+// scrub: verifies every allocated block against its checksum. worker threads
+// claim chunks of the image and pread() them whole, so the work is one big
+// sequential read split across cores
+// ---------------------------------------------------------------------------
+#define SCRUB_CHUNK 256 // blocks per claim
+
+typedef struct
+{
+    int fd;
+    uint8_t bmp[BLOCKSIZE];
+    uint32_t next; // first block of the next unclaimed chunk
+    uint32_t checked, bad;
+} ScrubState;
+
+void *scrub_worker(void *arg)
+{
+    ScrubState *st = arg;
+    uint8_t *buf = malloc(SCRUB_CHUNK * BLOCKSIZE);
+    if (!buf)
+        return NULL;
+
+    uint32_t count = sb.totalBlockCount < BLOCKSIZE * 8 ? sb.totalBlockCount : BLOCKSIZE * 8;
+    for (;;) {
+        uint32_t first = __atomic_fetch_add(&st->next, SCRUB_CHUNK, __ATOMIC_RELAXED);
+        if (first >= count)
+            break;
+        uint32_t n = count - first < SCRUB_CHUNK ? count - first : SCRUB_CHUNK;
+        ssize_t got = pread(st->fd, buf, (size_t)n * BLOCKSIZE, (off_t)first * BLOCKSIZE);
+        if (got < 0)
+            got = 0;
+
+        uint32_t checked = 0, bad = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t b = first + i;
+            if (!csum_covers(b) || !(st->bmp[b / 8] & (1 << (b & 7))))
+                continue;
+            checked++;
+            if ((uint64_t)(i + 1) * BLOCKSIZE > (uint64_t)got ||
+                crc32c(buf + (size_t)i * BLOCKSIZE, BLOCKSIZE) != csum_table[b]) {
+                fprintf(stderr, "scrub: block %u: checksum mismatch\n", b);
+                bad++;
+            }
+        }
+        __atomic_fetch_add(&st->checked, checked, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&st->bad, bad, __ATOMIC_RELAXED);
+    }
+    free(buf);
+    return NULL;
+}
+
+void cmd_scrub(const char *img, uint32_t threads)
+{
+    FILE *fp = open_image_rw(img);
+    load_super(fp); // checks the superblock
+    if (!(sb.featureFlags & FEATURE_CSUM))
+        die("scrub: image has no checksums (mkfs ... csum)");
+
+    static ScrubState st;
+    st.fd = fileno(fp);
+    raw_read(fp, BLOCK_BITMAP_OFFSET, st.bmp, BLOCKSIZE);
+    if (!threads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+
+    uint64_t t0 = now_ns();
+    pthread_t *tid = calloc(threads, sizeof *tid);
+    if (!tid)
+        die("calloc");
+    for (uint32_t t = 0; t < threads; t++)
+        if (pthread_create(&tid[t], NULL, scrub_worker, &st))
+            die("scrub: pthread_create");
+    for (uint32_t t = 0; t < threads; t++)
+        pthread_join(tid[t], NULL);
+    free(tid);
+    double secs = (now_ns() - t0) / 1e9;
+
+    close_image(fp);
+    printf("scrub: %u blocks verified, %u bad, %u threads, %.1f MiB/s\n",
+           st.checked, st.bad, threads,
+           (double)sb.totalBlockCount * BLOCKSIZE / secs / (1024.0 * 1024.0));
+    if (st.bad) {
+        errno = EIO;
+        die("scrub");
+    }
+}
+
+// ---------------------------------------------------------------------------
+// find: instead of walking the tree, the inode table is read in one go and
+// the directory blocks in block order; paths are put together afterwards
+// from the (parent, name) links found in the directories
+// ---------------------------------------------------------------------------
+typedef struct
+{
+    uint32_t child, parent;
+    char name[MAX_FILENAME];
+} FindLink;
+
+typedef struct
+{
+    const char *name; // glob on the last component, NULL = any
+    uint64_t min, max;
+    char type;        // 'f', 'd' or 0
+    bool dump;
+} FindQuery;
+
+typedef struct
+{
+    char *path;
+    uint32_t ino;
+} FindHit;
+
+int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+int cmp_hit(const void *a, const void *b)
+{
+    return strcmp(((const FindHit *)a)->path, ((const FindHit *)b)->path);
+}
+
+// path of a directory through its first link; depth-limited, since a
+// directory hard link (crhl) can form a cycle
+bool find_dir_path(uint32_t dir, const int32_t *first_link, const FindLink *links,
+                   char *out, size_t cap, uint32_t depth)
+{
+    if (dir == 0) {
+        out[0] = '\0';
+        return true;
+    }
+    if (first_link[dir] < 0 || depth > INODE_COUNT)
+        return false;
+    const FindLink *l = &links[first_link[dir]];
+    if (!find_dir_path(l->parent, first_link, links, out, cap, depth + 1))
+        return false;
+    path_append(out, cap, l->name);
+    return true;
+}
+
+void cmd_find(const char *img, const char *path, const FindQuery *q)
+{
+    FILE *fp = open_image_rw(img);
+    load_super(fp);
+
+    uint32_t parent_idx;
+    uint32_t start = path_lookup(fp, path, &parent_idx, NULL);
+    if (start == UINT32_MAX || (start == parent_idx && strcmp(path, "/") != 0))
+        die("find: path not found");
+
+    // the whole inode table and bitmap, one read each
+    static Inode itab[INODE_TABLE_BLOCKS * BLOCKSIZE / INODE_SIZE];
+    uint8_t ibmp[INODE_COUNT / 8];
+    read_at(fp, INODE_BITMAP_OFFSET, ibmp, sizeof ibmp);
+    read_at(fp, INODE_TABLE_OFFSET, itab, sizeof itab);
+    uint32_t icount = sb.totalInodeCount < INODE_COUNT ? sb.totalInodeCount : INODE_COUNT;
+
+    // directory blocks sorted by position, physically adjacent ones read together
+    uint32_t dirblk[INODE_COUNT], dirino[INODE_COUNT], ndirs = 0;
+    for (uint32_t i = 0; i < icount; i++)
+        if ((ibmp[i / 8] & (1 << (i & 7))) && itab[i].isDirectory)
+            dirblk[ndirs++] = itab[i].directPointers[0];
+    qsort(dirblk, ndirs, sizeof *dirblk, cmp_u32);
+    for (uint32_t i = 0; i < ndirs; i++) // the owner of each block, in the same order
+        for (uint32_t j = 0; j < icount; j++)
+            if ((ibmp[j / 8] & (1 << (j & 7))) && itab[j].isDirectory &&
+                itab[j].directPointers[0] == dirblk[i]) {
+                dirino[i] = j;
+                break;
+            }
+
+    static DirectoryEntry ents[INODE_COUNT][DIRS_PER_BLOCK];
+    for (uint32_t i = 0, n; i < ndirs; i += n) {
+        for (n = 1; i + n < ndirs && dirblk[i + n] == dirblk[i] + n; n++)
+            ;
+        read_blocks(fp, dirblk[i], n, ents[i]);
+    }
+
+    // (parent, name) links; an inode has one per path
+    static FindLink links[INODE_COUNT * DIRS_PER_BLOCK];
+    int32_t first_link[INODE_COUNT];
+    memset(first_link, -1, sizeof first_link);
+    uint32_t nlinks = 0;
+    for (uint32_t i = 0; i < ndirs; i++)
+        for (uint32_t k = 0; k < DIRS_PER_BLOCK; k++) {
+            DirectoryEntry *e = &ents[i][k];
+            if (!e->inodeIndex || e->inodeIndex >= icount ||
+                !strcmp(e->name, ".") || !strcmp(e->name, ".."))
+                continue;
+            FindLink *l = &links[nlinks];
+            l->child = e->inodeIndex;
+            l->parent = dirino[i];
+            memcpy(l->name, e->name, MAX_FILENAME);
+            l->name[MAX_FILENAME - 1] = '\0';
+            if (first_link[l->child] < 0)
+                first_link[l->child] = (int32_t)nlinks;
+            nlinks++;
+        }
+
+    // the scope as a path prefix, "" for the whole image
+    char scope[1024] = "";
+    if (strcmp(path, "/") != 0)
+        snprintf(scope, sizeof scope, "%s", path);
+    size_t slen = strlen(scope);
+    while (slen && scope[slen - 1] == '/')
+        scope[--slen] = '\0';
+
+    FindHit *hits = malloc((nlinks + 1) * sizeof *hits);
+    if (!hits)
+        die("malloc");
+    uint32_t nhits = 0;
+    for (uint32_t i = 0; i <= nlinks; i++) {
+        uint32_t ino = i < nlinks ? links[i].child : 0; // the last round is / itself
+        const char *leaf = i < nlinks ? links[i].name : "/";
+        const Inode *in = &itab[ino];
+
+        if (q->type && (q->type == 'd') != (in->isDirectory != 0))
+            continue;
+        if (!in->isDirectory && (in->size < q->min || in->size > q->max))
+            continue;
+        if (in->isDirectory && (q->min || q->max != UINT64_MAX))
+            continue;
+        if (q->name && fnmatch(q->name, leaf, 0) != 0)
+            continue;
+
+        char p[4096];
+        if (i == nlinks)
+            strcpy(p, "/");
+        else {
+            if (!find_dir_path(links[i].parent, first_link, links, p, sizeof p, 0))
+                continue; // unreachable from /
+            path_append(p, sizeof p, leaf);
+        }
+        if (slen && (strncmp(p, scope, slen) != 0 || (p[slen] && p[slen] != '/')))
+            continue;
+
+        hits[nhits].path = strdup(p);
+        if (!hits[nhits].path)
+            die("strdup");
+        hits[nhits].ino = ino;
+        nhits++;
+    }
+    qsort(hits, nhits, sizeof *hits, cmp_hit);
+
+    if (q->dump)
+        printf("%6s %4s %8s %5s %6s  %s\n", "inode", "type", "size", "links", "blocks", "path");
+    for (uint32_t i = 0; i < nhits; i++) {
+        const Inode *in = &itab[hits[i].ino];
+        if (q->dump)
+            printf("%6u %4s %8u %5u %6u  %s\n", hits[i].ino, in->isDirectory ? "d" : "f",
+                   in->size, in->linkCount, inode_blocks(in), hits[i].path);
+        else
+            printf("%s\n", hits[i].path);
+        free(hits[i].path);
+    }
+    free(hits);
+    close_image(fp);
+}
+
+// ---------------------------------------------------------------------------
+// clone-compact: a sparse copy of the image holding only allocated blocks.
+// dense renumbers them by rank, so they end up packed at the start; every
+// per-block structure is permuted along: the bitmap, the pointers in the
+// inode table, the refcount, checksum and change tables and the dedup index.
+// the blocks are read through the checksums, so a corrupt source fails the
+// clone instead of getting fresh checksums in it
+// ---------------------------------------------------------------------------
+void pwrite_full(int fd, const void *buf, size_t n, uint64_t off)
+{
+    if (pwrite(fd, buf, n, off) != (ssize_t)n)
+        die("clone-compact: write");
+}
+
+// writes len bytes of rewritten metadata to block first of the clone and
+// checksums them into tab (NULL without FEATURE_CSUM)
+void clone_write(int out, uint32_t *tab, const void *buf, size_t len, uint32_t first)
+{
+    pwrite_full(out, buf, len, (uint64_t)first * BLOCKSIZE);
+    for (size_t i = 0; tab && i < len / BLOCKSIZE; i++)
+        tab[first + i] = crc32c((const uint8_t *)buf + i * BLOCKSIZE, BLOCKSIZE);
+}
+
+void cmd_clone_compact(const char *img, const char *dst, bool dense)
+{
+    FILE *fp = open_image_rw(img);
+    load_super(fp);
+
+    // O_TRUNC on the source itself would wipe it before it is read
+    struct stat src_st, dst_st;
+    if (fstat(fileno(fp), &src_st))
+        die("clone-compact: stat");
+    if (stat(dst, &dst_st) == 0 && dst_st.st_dev == src_st.st_dev && dst_st.st_ino == src_st.st_ino) {
+        errno = EINVAL;
+        die("clone-compact: destination is the image itself");
+    }
+
+    int out = open(dst, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+        die("clone-compact: create");
+    if (ftruncate(out, (off_t)sb.totalBlockCount * BLOCKSIZE))
+        die("clone-compact: truncate");
+
+    uint8_t bmp[BLOCKSIZE];
+    uint32_t count = sb.totalBlockCount < BLOCKSIZE * 8 ? sb.totalBlockCount : BLOCKSIZE * 8;
+    read_at(fp, BLOCK_BITMAP_OFFSET, bmp, BLOCKSIZE);
+
+    static uint32_t map[BLOCKSIZE * 8]; // old block -> block in the clone
+    uint32_t used = 0;
+    for (uint32_t b = 0; b < count; b++)
+        if (bmp[b / 8] & (1 << (b & 7))) {
+            map[b] = dense ? used : b;
+            used++;
+        }
+
+    // allocated blocks, runs that stay runs in one piece
+    static uint8_t chunk[RUN_MAX_BLOCKS * BLOCKSIZE];
+    for (uint32_t b = 0, n; b < count; b += n) {
+        n = 1;
+        if (!(bmp[b / 8] & (1 << (b & 7))))
+            continue;
+        while (b + n < count && n < RUN_MAX_BLOCKS && (bmp[(b + n) / 8] & (1 << ((b + n) & 7))))
+            n++;
+        read_blocks(fp, b, n, chunk);
+        pwrite_full(out, chunk, (size_t)n * BLOCKSIZE, (uint64_t)map[b] * BLOCKSIZE);
+    }
+
+    // data blocks keep their checksums, they just move along with the block;
+    // free blocks read as zeros in the clone
+    uint32_t *tab = NULL;
+    if (sb.featureFlags & FEATURE_CSUM) {
+        tab = calloc(1, (size_t)sb.csumBlocks * BLOCKSIZE);
+        if (!tab)
+            die("calloc");
+        for (uint32_t b = 0; b < count; b++)
+            if ((bmp[b / 8] & (1 << (b & 7))) && csum_covers(b))
+                tab[map[b]] = csum_table[b];
+    }
+
+    if (dense) {
+        uint8_t nbmp[BLOCKSIZE] = {0};
+        for (uint32_t b = 0; b < used; b++)
+            nbmp[b / 8] |= 1 << (b & 7);
+        clone_write(out, tab, nbmp, BLOCKSIZE, BLOCK_BITMAP_OFFSET / BLOCKSIZE);
+
+        static Inode itab[INODE_TABLE_BLOCKS * BLOCKSIZE / INODE_SIZE];
+        uint8_t ibmp[INODE_COUNT / 8];
+        read_at(fp, INODE_BITMAP_OFFSET, ibmp, sizeof ibmp);
+        read_at(fp, INODE_TABLE_OFFSET, itab, sizeof itab);
+        for (uint32_t i = 0; i < INODE_COUNT; i++) {
+            if (!(ibmp[i / 8] & (1 << (i & 7))) || (itab[i].flags & INODE_INLINE))
+                continue;
+            for (uint32_t k = 0; k < DIRECTBLOCK_CNT; k++)
+                if (itab[i].directPointers[k] && itab[i].directPointers[k] < count)
+                    itab[i].directPointers[k] = map[itab[i].directPointers[k]];
+        }
+        clone_write(out, tab, itab, sizeof itab, INODE_TABLE_OFFSET / BLOCKSIZE);
+
+        if (sb.refcountBlocks) {
+            size_t len = (size_t)sb.refcountBlocks * BLOCKSIZE;
+            uint16_t *old = malloc(len), *ref = calloc(1, len);
+            if (!old || !ref)
+                die("malloc");
+            read_at(fp, (uint64_t)sb.refcountStart * BLOCKSIZE, old, len);
+            for (uint32_t b = 0; b < count; b++)
+                if (bmp[b / 8] & (1 << (b & 7)))
+                    ref[map[b]] = old[b];
+            sb.refcountStart = map[sb.refcountStart];
+            clone_write(out, tab, ref, len, sb.refcountStart);
+            free(old);
+            free(ref);
+        }
+        if (sb.dedupIndexBlocks) {
+            size_t len = (size_t)sb.dedupIndexBlocks * BLOCKSIZE;
+            DedupSlot *slots = malloc(len);
+            if (!slots)
+                die("malloc");
+            read_at(fp, (uint64_t)sb.dedupIndexStart * BLOCKSIZE, slots, len);
+            for (uint32_t i = 0; i < len / sizeof *slots; i++) // hashes stay, so do the slots
+                if (slots[i].blk && slots[i].blk != DEDUP_TOMBSTONE && slots[i].blk < count)
+                    slots[i].blk = map[slots[i].blk];
+            sb.dedupIndexStart = map[sb.dedupIndexStart];
+            clone_write(out, tab, slots, len, sb.dedupIndexStart);
+            free(slots);
+        }
+        if (sb.genmapBlocks) {
+            size_t len = (size_t)sb.genmapBlocks * BLOCKSIZE;
+            uint32_t *gens = calloc(1, len);
+            if (!gens)
+                die("calloc");
+            for (uint32_t b = 0; b < count; b++)
+                if (bmp[b / 8] & (1 << (b & 7)))
+                    gens[map[b]] = gen_table[b];
+            sb.genmapStart = map[sb.genmapStart];
+            pwrite_full(out, gens, len, (uint64_t)sb.genmapStart * BLOCKSIZE); // not checksummed
+            free(gens);
+            // the blocks have new numbers, a stream from the source would
+            // land on the wrong ones: the clone starts a lineage of its own
+            random_fill(&sb.lineage, sizeof sb.lineage);
+        }
+        if (sb.csumBlocks)
+            sb.csumStart = map[sb.csumStart];
+    }
+
+    if (tab) {
+        uint8_t zero[BLOCKSIZE] = {0};
+        uint32_t zero_csum = crc32c(zero, BLOCKSIZE);
+        for (uint32_t b = 0; b < sb.totalBlockCount; b++) {
+            bool alloc = b < count && (dense ? b < used : (bmp[b / 8] & (1 << (b & 7))) != 0);
+            if (!csum_covers(b))
+                tab[b] = 0;
+            else if (!alloc)
+                tab[b] = zero_csum;
+        }
+        pwrite_full(out, tab, (size_t)sb.csumBlocks * BLOCKSIZE, (uint64_t)sb.csumStart * BLOCKSIZE);
+        free(tab);
+        sb.superCsum = 0;
+        sb.superCsum = crc32c(&sb, sizeof sb);
+    }
+    pwrite_full(out, &sb, sizeof sb, 0);
+
+    if (fsync(out) || close(out))
+        die("clone-compact: write");
+    close_image(fp);
+    printf("clone-compact: %u blocks (%u KiB) -> %s%s\n",
+           used, used * (BLOCKSIZE / 1024), dst, dense ? " (dense)" : "");
+}
+
+// ---------------------------------------------------------------------------
+// send / receive: the blocks written after a generation, as a stream that
+// brings a copy of the image taken at that generation (or later) up to date.
+//   SendHeader | SendRun + count blocks | ... | SendRun with count 0
+// block 0 comes last, so an interrupted receive leaves the old generation in
+// the superblock and can simply be repeated
+// ---------------------------------------------------------------------------
+#define SEND_MAGIC 0x444e5356u // "VSND"
+
+#pragma pack(push, 1)
+typedef struct
+{
+    uint32_t magic;
+    uint32_t since;      // blocks newer than this are in the stream
+    uint32_t generation; // the sender's generation
+    uint32_t totalBlockCount;
+    uint64_t lineage; // the receiver must be a copy of the same image
+    uint32_t sinceTag; // ... and hold the same generation since
+} SendHeader;
+
+typedef struct
+{
+    uint32_t first;
+    uint32_t count; // 0 ends the stream
+    uint32_t crc;   // CRC32C of the run's data
+} SendRun;
+#pragma pack(pop)
+
+void send_run(FILE *fp, FILE *out, uint32_t first, uint32_t n, uint8_t *buf, uint32_t *sent)
+{
+    read_blocks(fp, first, n, buf);
+    SendRun r = {first, n, crc32c(buf, (size_t)n * BLOCKSIZE)};
+    if (fwrite(&r, sizeof r, 1, out) != 1 || fwrite(buf, BLOCKSIZE, n, out) != n)
+        die("send: write");
+    *sent += n;
+}
+
+void cmd_send(const char *img, uint32_t since, const char *out_path)
+{
+    FILE *fp = open_image_ro(img);
+    load_super(fp);
+    if (!gen_table)
+        die("send: image has no change map (mkfs ... changemap)");
+    if (since > sb.generation)
+        die("send: generation is in the future");
+    uint32_t tag;
+    if (!gen_tag(since, &tag)) {
+        errno = EINVAL;
+        die("send: generation is too old, send from a later one");
+    }
+
+    bool to_stdout = strcmp(out_path, "-") == 0;
+    FILE *out = to_stdout ? stdout : fopen(out_path, "wb");
+    if (!out)
+        die("send: open output");
+
+    SendHeader h = {SEND_MAGIC, since, sb.generation, sb.totalBlockCount, sb.lineage, tag};
+    if (fwrite(&h, sizeof h, 1, out) != 1)
+        die("send: write");
+
+    static uint8_t buf[RUN_MAX_BLOCKS * BLOCKSIZE];
+    uint32_t sent = 0;
+    for (uint32_t b = 1, n; b < sb.totalBlockCount; b += n) {
+        n = 1;
+        if (gen_table[b] <= since)
+            continue;
+        while (b + n < sb.totalBlockCount && n < RUN_MAX_BLOCKS && gen_table[b + n] > since)
+            n++;
+        send_run(fp, out, b, n, buf, &sent);
+    }
+    send_run(fp, out, 0, 1, buf, &sent);
+
+    SendRun end = {0, 0, 0};
+    if (fwrite(&end, sizeof end, 1, out) != 1 || fflush(out))
+        die("send: write");
+    if (!to_stdout)
+        fclose(out);
+    close_image(fp);
+
+    if (!to_stdout)
+        printf("send: %u of %u blocks, generation %u -> %u\n",
+               sent, sb.totalBlockCount, since, h.generation);
+}
+
+void cmd_receive(const char *img, const char *in_path)
+{
+    FILE *fp = open_image_rw(img);
+    load_super(fp);
+    fflush(fp);
+
+    FILE *in = strcmp(in_path, "-") == 0 ? stdin : fopen(in_path, "rb");
+    if (!in)
+        die("receive: open input");
+
+    SendHeader h;
+    if (fread(&h, sizeof h, 1, in) != 1 || h.magic != SEND_MAGIC)
+        die("receive: not a send stream");
+    if (h.totalBlockCount != sb.totalBlockCount || h.lineage != sb.lineage) {
+        errno = EINVAL;
+        die("receive: stream is from another image");
+    }
+    // the copy must be exactly what the sender was at since: a copy at
+    // another generation, or one that got to since through writes of its
+    // own, holds other blocks under the same numbers
+    if (sb.generation != h.since) {
+        fprintf(stderr, "receive: image is at generation %u, stream starts at %u\n",
+                sb.generation, h.since);
+        errno = EINVAL;
+        die("receive");
+    }
+    uint32_t tag;
+    if (!gen_tag(sb.generation, &tag) || tag != h.sinceTag) {
+        fprintf(stderr, "receive: image was written on its own at generation %u\n", sb.generation);
+        errno = EINVAL;
+        die("receive");
+    }
+
+    static uint8_t buf[RUN_MAX_BLOCKS * BLOCKSIZE];
+    uint32_t received = 0;
+    int fd = fileno(fp);
+    for (;;) {
+        SendRun r;
+        if (fread(&r, sizeof r, 1, in) != 1)
+            die("receive: truncated stream");
+        if (!r.count)
+            break;
+        if (r.count > RUN_MAX_BLOCKS || (uint64_t)r.first + r.count > sb.totalBlockCount ||
+            fread(buf, BLOCKSIZE, r.count, in) != r.count)
+            die("receive: truncated stream");
+        if (crc32c(buf, (size_t)r.count * BLOCKSIZE) != r.crc) {
+            errno = EIO;
+            die("receive: corrupt stream");
+        }
+        if (r.first == 0 && fsync(fd)) // everything else is down before the superblock
+            die("receive: fsync");
+        if (pwrite(fd, buf, (size_t)r.count * BLOCKSIZE, (off_t)r.first * BLOCKSIZE) != (ssize_t)r.count * BLOCKSIZE)
+            die("receive: write");
+        received += r.count;
+    }
+    if (fsync(fd))
+        die("receive: fsync");
+    if (in != stdin)
+        fclose(in);
+    close_image(fp);
+
+    printf("receive: %u blocks, generation %u -> %u\n", received, sb.generation, h.generation);
+}
+
+void usage()
+{
+    exit_status = 1;
+    printf("Usage: vfs [--stats[=table|json|prom[:file]]] [--trace=file] <imagepath> <command> [args]\n");
+    printf("Commands:\n");
+    printf("\tmkfs <bytes> [features]\t\t- create an empty image, features: compress dedup csum discard changemap\n");
+    printf("\tmkdir <path>\t\t\t- create directory at path\n");
+    printf("\trmdir <path>\t\t\t- remove directory at path\n");
+    printf("\tls <path>\t\t\t- list items at path\n");
+    printf("\tdf\t\t\t\t- show disk usage of the image\n");
+    printf("\tlsdf <path>\t\t\t- show disk usage of the pathitem\n");
+    printf("\tcrhl <path> <path>\t\t- create a hard link to file or dir\n");
+    printf("\tcp [--reflink] <path> <path>\t- copy a file, reflink shares its blocks\n");
+    printf("\trm <path>\t\t\t- remove a file or link\n");
+    printf("\text <path> <n>\t\t\t- add n bytes to a file\n");
+    printf("\tred <path> <n>\t\t\t- reduce n bytes from a file\n");
+    printf("\tdu <path>\t\t\t- display info about disk usage\n");
+    printf("\tdedup-scan [blocks/s]\t\t- share identical data blocks, enables dedup\n");
+    printf("\tfind [path] [-name glob] [-size lo:hi] [-type f|d] [-dump]\n\t\t\t\t\t- query files by scanning the inode table\n");
+    printf("\tclone-compact <ext_path> [dense]\t- sparse copy of the allocated blocks, dense renumbers\n");
+    printf("\tsend --since <gen> [file|-]\t- blocks written after generation gen (mkfs ... changemap)\n");
+    printf("\treceive [file|-]\t\t- apply a send stream to an older copy of the image\n");
+    printf("\tscrub [threads]\t\t\t- verify all checksums (mkfs ... csum)\n");
+    printf("\tfrag [path]\t\t\t- per-file fragments and free extent histogram\n");
+    printf("\tdefrag [path] [blocks/s]\t- move fragmented files into contiguous runs\n");
+    printf("\timport [-j n] <ext_dir> <path>\t- copy a host tree into directory path\n");
+    printf("\texport <path> [file|-]\t\t- write path and below as a tar stream\n");
+
+    printf("\tecpt [-z] <ext_path> <path>\t- external copy to disk (-z: compressed)\n");
+    printf("\tecpf <path> <ext_path>\t\t- external copy from disk\n");
+    printf("\tput [-t] [-z] <ext_path|-> <path>\t- store a stream of unknown length (-t: read on a thread)\n");
+    printf("\tget <path> <ext_path|->\t\t- same as ecpf, - writes to stdout\n");
+}
+
+int main(int argc, char *argv[])
+{
+    // global options come before the image path; VFS_TRACE lets scripts
+    // record a workload without touching every invocation
+    const char *trace_path = getenv("VFS_TRACE");
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0)
+    {
+        if (strcmp(argv[1], "--stats") == 0)
+            stats_format = "table";
+        else if (strncmp(argv[1], "--stats=", 8) == 0)
+        {
+            stats_format = argv[1] + 8;
+            if (strcmp(stats_format, "table") != 0 && strcmp(stats_format, "json") != 0 &&
+                strcmp(stats_format, "prom") != 0 &&
+                (strncmp(stats_format, "prom:", 5) != 0 || !stats_format[5]))
+            {
+                usage();
+                return 1;
+            }
+        }
+        else if (strncmp(argv[1], "--trace=", 8) == 0)
+            trace_path = argv[1] + 8;
+        else
+        {
+            usage();
+            return 1;
+        }
+        argv++;
+        argc--;
+    }
+
+    if (argc < 3)
+    {
+        usage();
+        return 1;
+    }
+
+    const char *img = argv[1];
+    const char *cmd = argv[2];
+
+    if (stats_format)
+    {
+        stats_cmd = cmd;
+        stats_timed = true;
+        stats_start_ns = now_ns();
+        atexit(stats_report); // also runs when a command die()s
+    }
+
+    if (trace_path && *trace_path)
+    {
+        trace_open(trace_path);
+        trace_argc = argc - 2;
+        trace_argv = argv + 2;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        trace_start_wall = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        trace_start_ns = now_ns();
+        atexit(trace_write);
+    }
+
+    if (strcmp(cmd, "mkfs") == 0)
+    {
+        if (argc < 4)
+        {
+            usage();
+            return 1;
+        }
+        uint32_t features = 0;
+        for (int i = 4; i < argc; i++)
+        {
+            if (strcmp(argv[i], "compress") == 0)
+                features |= FEATURE_COMPRESS;
+            else if (strcmp(argv[i], "dedup") == 0)
+                features |= FEATURE_DEDUP;
+            else if (strcmp(argv[i], "csum") == 0)
+                features |= FEATURE_CSUM;
+            else if (strcmp(argv[i], "discard") == 0)
+                features |= FEATURE_DISCARD;
+            else if (strcmp(argv[i], "changemap") == 0)
+                features |= FEATURE_CHANGEMAP;
+            else
+            {
+                usage();
+                return 1;
+            }
+        }
+        cmd_mkfs(img, strtoull(argv[3], NULL, 10), features);
+        return 0;
+    }
+    else if (strcmp(cmd, "mkdir") == 0)
+    {
+        if (argc != 4)
+        {
+            usage();
+            return 1;
+        }
+        cmd_mkdir(img, argv[3]);
+        return 0;
+    }
+    else if (strcmp(cmd, "ls") == 0)
+    {
+        if (argc != 4)
+        {
+            usage();
+            return 1;
+        }
+        cmd_ls(img, argv[3]);
+        return 0;
+    }
+    else if(strcmp(cmd, "df") == 0)
+    {
+        if (argc != 3)
+        {
+            usage();
+            return 1;
+        }
+        cmd_df(img);
+        return 0;
+    }
+    else if (strcmp(cmd, "rmdir") == 0)
+    {
+        if (argc != 4)
+        {
+            usage();
+            return 1;
+        }
+        cmd_rmdir(img, argv[3]);
+        return 0; 
+    }else if (strcmp(cmd, "ecpt") == 0)
+    {
+        if (argc == 6 && strcmp(argv[3], "-z") == 0)
+        {
+            cmd_ecpt(img, argv[4], argv[5], true);
+            return 0;
+        }
+        if (argc != 5)
+        {
+            usage();
+            return 1;
+        }
+        cmd_ecpt(img, argv[3], argv[4], false);
+        return 0;
+    }
+    else if (strcmp(cmd, "put") == 0)
+    {
+        bool threaded = false, compress = false;
+        for (; argc > 5 && argv[3][0] == '-' && argv[3][1]; argv++, argc--)
+        {
+            if (strcmp(argv[3], "-t") == 0)
+                threaded = true;
+            else if (strcmp(argv[3], "-z") == 0)
+                compress = true;
+            else
+                break;
+        }
+        if (argc != 5) { usage(); return 1; }
+        cmd_put(img, argv[3], argv[4], threaded, compress);
+        return 0;
+    }
+    else if (strcmp(cmd, "ecpf") == 0 || strcmp(cmd, "get") == 0)
+    {
+        if (argc != 5)
+        {
+            usage();
+            return 1;
+        }
+        cmd_ecpf(img, argv[3], argv[4]);
+        return 0;
+    }
+    else if (strcmp(cmd, "lsdf") == 0)
+    {
+        if (argc != 4) { usage(); return 1; }
+        cmd_lsdf(img, argv[3]);
+        return 0;
+    }
+    else if (strcmp(cmd, "crhl") == 0)
+    {
+        if (argc != 5) { usage(); return 1; }
+        cmd_crhl(img, argv[3], argv[4]);
+        return 0;
+    }
+    else if (strcmp(cmd, "cp") == 0)
+    {
+        if (argc == 6 && strcmp(argv[3], "--reflink") == 0)
+        {
+            cmd_cp(img, argv[4], argv[5], true);
+            return 0;
+        }
+        if (argc != 5) { usage(); return 1; }
+        cmd_cp(img, argv[3], argv[4], false);
+        return 0;
+    }
+    else if (strcmp(cmd, "rm") == 0)
+    {
+        if (argc != 4) { usage(); return 1; }
+        cmd_rm(img, argv[3]);
+        return 0;
+    }
+    else if (strcmp(cmd, "ext") == 0)
+    {
+        if (argc != 5) { usage(); return 1; }
+        cmd_ext(img, argv[3], (uint32_t)strtoul(argv[4], NULL, 10));
+        return 0;
+    }
+    else if (strcmp(cmd, "red") == 0)
+    {
+        if (argc != 5) { usage(); return 1; }
+        cmd_red(img, argv[3], (uint32_t)strtoul(argv[4], NULL, 10));
+        return 0;
+    }
+    else if (strcmp(cmd, "du") == 0)
+    {
+        if(argc != 4) { usage(); return 1; }
+        cmd_du(img, argv[3]);
+        return 0;
+    }
+    else if (strcmp(cmd, "dedup-scan") == 0)
+    {
+        if (argc > 4) { usage(); return 1; }
+        cmd_dedup_scan(img, argc == 4 ? (uint32_t)strtoul(argv[3], NULL, 10) : 0);
+        return 0;
+    }
+    else if (strcmp(cmd, "import") == 0)
+    {
+        uint32_t threads = 4;
+        if (argc == 7 && strcmp(argv[3], "-j") == 0)
+        {
+            threads = (uint32_t)strtoul(argv[4], NULL, 10);
+            argv += 2;
+            argc -= 2;
+        }
+        if (argc != 5 || threads == 0) { usage(); return 1; }
+        cmd_import(img, argv[3], argv[4], threads);
+        return 0;
+    }
+    else if (strcmp(cmd, "export") == 0)
+    {
+        if (argc != 4 && argc != 5) { usage(); return 1; }
+        cmd_export(img, argv[3], argc == 5 ? argv[4] : "-");
+        return 0;
+    }
+    else if (strcmp(cmd, "find") == 0)
+    {
+        FindQuery q = {.max = UINT64_MAX};
+        const char *path = "/";
+        int i = 3;
+        if (i < argc && argv[i][0] == '/')
+            path = argv[i++];
+        for (; i < argc; i++)
+        {
+            if (strcmp(argv[i], "-name") == 0 && i + 1 < argc)
+                q.name = argv[++i];
+            else if (strcmp(argv[i], "-type") == 0 && i + 1 < argc &&
+                     (strcmp(argv[i + 1], "f") == 0 || strcmp(argv[i + 1], "d") == 0))
+                q.type = argv[++i][0];
+            else if (strcmp(argv[i], "-size") == 0 && i + 1 < argc)
+            {
+                // lo:hi in bytes, either side may be left out; a single number is exact
+                char *s = argv[++i], *colon = strchr(s, ':');
+                q.min = strtoull(s, NULL, 10);
+                q.max = !colon ? q.min : colon[1] ? strtoull(colon + 1, NULL, 10) : UINT64_MAX;
+            }
+            else if (strcmp(argv[i], "-dump") == 0)
+                q.dump = true;
+            else { usage(); return 1; }
+        }
+        cmd_find(img, path, &q);
+        return 0;
+    }
+    else if (strcmp(cmd, "clone-compact") == 0)
+    {
+        if (argc == 5 && strcmp(argv[4], "dense") != 0) { usage(); return 1; }
+        if (argc != 4 && argc != 5) { usage(); return 1; }
+        cmd_clone_compact(img, argv[3], argc == 5);
+        return 0;
+    }
+    else if (strcmp(cmd, "send") == 0)
+    {
+        if ((argc != 5 && argc != 6) || strcmp(argv[3], "--since") != 0) { usage(); return 1; }
+        char *end;
+        errno = 0;
+        unsigned long since = strtoul(argv[4], &end, 10);
+        if (argv[4][0] < '0' || argv[4][0] > '9' || *end || errno || since > UINT32_MAX) { usage(); return 1; }
+        cmd_send(img, (uint32_t)since, argc == 6 ? argv[5] : "-");
+        return 0;
+    }
+    else if (strcmp(cmd, "receive") == 0)
+    {
+        if (argc > 4) { usage(); return 1; }
+        cmd_receive(img, argc == 4 ? argv[3] : "-");
+        return 0;
+    }
+    else if (strcmp(cmd, "scrub") == 0)
+    {
+        if (argc > 4) { usage(); return 1; }
+        cmd_scrub(img, argc == 4 ? (uint32_t)strtoul(argv[3], NULL, 10) : 0);
+        return 0;
+    }
+    else if (strcmp(cmd, "frag") == 0)
+    {
+        if (argc > 4) { usage(); return 1; }
+        cmd_frag(img, argc == 4 ? argv[3] : "/", false, 0);
+        return 0;
+    }
+    else if (strcmp(cmd, "defrag") == 0)
+    {
+        if (argc > 5) { usage(); return 1; }
+        cmd_frag(img, argc >= 4 ? argv[3] : "/", true,
+                 argc == 5 ? (uint32_t)strtoul(argv[4], NULL, 10) : 0);
         return 0;
     }
 